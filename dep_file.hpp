@@ -0,0 +1,120 @@
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+// Read the whole file into the buffer at once. Returns false if
+// the file could not be opened.
+inline bool read_file(const std::filesystem::path& path, std::string& buffer) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+
+    buffer.resize(st.st_size);
+    size_t size = 0;
+    while (size < buffer.size()) {
+        ssize_t n = read(fd, buffer.data() + size, buffer.size() - size);
+        if (n <= 0) break;
+        size += n;
+    }
+    buffer.resize(size);
+    close(fd);
+    return true;
+}
+
+namespace dep_file {
+    inline bool is_special(char c) {
+        return c == ' ' || c == '\n' || c == '\\' || c == ':' || c == '\t' || c == '\r';
+    }
+
+    // Find the first special character at or after pos. Uses SSE2 to
+    // check 16 characters at a time where available.
+    inline size_t find_special(const char* data, size_t pos, size_t size) {
+#ifdef __SSE2__
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i newline = _mm_set1_epi8('\n');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i colon = _mm_set1_epi8(':');
+        const __m128i tab = _mm_set1_epi8('\t');
+        const __m128i carriage_return = _mm_set1_epi8('\r');
+        for (; pos + 16 <= size; pos += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(data + pos));
+            __m128i m = _mm_or_si128(
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, newline)),
+                             _mm_or_si128(_mm_cmpeq_epi8(v, backslash), _mm_cmpeq_epi8(v, colon))),
+                _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, carriage_return)));
+            int mask = _mm_movemask_epi8(m);
+            if (mask != 0)
+                return pos + __builtin_ctz(mask);
+        }
+#endif
+        for (; pos < size; ++pos)
+            if (is_special(data[pos]))
+                return pos;
+        return size;
+    }
+}
+
+// Parse the dependencies of a Makefile .d file, and call the callback with
+// every dependency. The targets (everything in front of a ':') are skipped.
+// Tokens point directly into the content, unless they contain escaped spaces.
+// Stops and returns false when the callback returns false.
+template<typename F>
+bool parse_dep_file(std::string_view content, F&& callback) {
+    const char* data = content.data();
+    size_t size = content.size();
+
+    std::string escaped; // The current token, if it contains escapes.
+    bool is_escaped = false;
+    size_t start = 0;
+    size_t pos = 0;
+
+    while (true) {
+        size_t next = dep_file::find_special(data, pos, size);
+        if (is_escaped)
+            escaped.append(data + pos, next - pos);
+
+        char c = next < size ? data[next] : '\n';
+        if (c == '\\') {
+            // "\ " is an escaped space, any other escape (like a line continuation) is skipped.
+            if (!is_escaped) {
+                escaped.assign(data + start, next - start);
+                is_escaped = true;
+            }
+            if (next + 1 < size && data[next + 1] == ' ')
+                escaped += ' ';
+            pos = std::min(next + 2, size);
+            continue;
+        }
+
+        if (c != ':') {
+            // End of the token, so push it.
+            if (is_escaped) {
+                if (!escaped.empty() && !callback(std::string_view(escaped)))
+                    return false;
+            }
+            else if (next > start && !callback(std::string_view(data + start, next - start)))
+                return false;
+        }
+
+        if (next >= size)
+            return true;
+        is_escaped = false;
+        start = pos = next + 1;
+    }
+}
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+
+// Class that watches a set of files for changes using inotify. A
+// background thread collects the changed paths, which can be waited
+// for with wait_for_changes(). The file descriptors are only opened
+// when they are first needed, so a static watcher doesn't take the
+// numbers of inherited file descriptors, like those of the jobserver.
+class FileWatcher {
+public:
+    ~FileWatcher() {
+        stop();
+        if (inotify_fd >= 0)
+            close(inotify_fd);
+        if (stop_fd >= 0)
+            close(stop_fd);
+    }
+
+    // Watch the given file. We watch its parent directory instead of the
+    // file itself, as most editors save by replacing the file.
+    bool watch(const std::filesystem::path& file) {
+        std::filesystem::path path = file.lexically_normal();
+        std::filesystem::path directory = path.has_parent_path() ? path.parent_path() : ".";
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (inotify_fd < 0)
+            inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (!files.insert(path).second)
+            return true;
+
+        if (!watched_directories.contains(directory)) {
+            int wd = inotify_add_watch(inotify_fd, directory.c_str(),
+                                       IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (wd < 0)
+                return false;
+            directories[wd] = directory;
+            watched_directories.insert(directory);
+        }
+        return true;
+    }
+
+    // Start the background thread which reads the inotify events.
+    void start() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (inotify_fd < 0)
+                inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        }
+        stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        thread = std::thread([this] {
+            alignas(inotify_event) char buffer[4096];
+            pollfd fds[2] = { { inotify_fd, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+
+            while (true) {
+                if (poll(fds, 2, -1) < 0 && errno != EINTR)
+                    return;
+                if (fds[1].revents & POLLIN)
+                    return;
+                if (!(fds[0].revents & POLLIN))
+                    continue;
+
+                ssize_t length;
+                while ((length = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    for (char* ptr = buffer; ptr < buffer + length; ) {
+                        inotify_event* event = (inotify_event*)ptr;
+                        ptr += sizeof(inotify_event) + event->len;
+
+                        // Events were lost, so any of the files might have
+                        // changed. They are all reported, to be checked again.
+                        if (event->mask & IN_Q_OVERFLOW) {
+                            last_change = std::chrono::steady_clock::now();
+                            changes.assign(files.begin(), files.end());
+                            continue;
+                        }
+                        if (event->len == 0)
+                            continue;
+
+                        auto it = directories.find(event->wd);
+                        if (it == directories.end())
+                            continue;
+
+                        // Only report the files we're actually interested in.
+                        std::filesystem::path path = it->second == "."
+                            ? std::filesystem::path(event->name)
+                            : it->second / event->name;
+                        if (files.contains(path)) {
+                            last_change = std::chrono::steady_clock::now();
+                            if (std::find(changes.begin(), changes.end(), path) == changes.end())
+                                changes.push_back(std::move(path));
+                        }
+                    }
+                }
+                condition.notify_all();
+            }
+        });
+    }
+
+    // Stop watching, and wake up everyone waiting for changes.
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopped = true;
+        }
+        condition.notify_all();
+
+        if (thread.joinable()) {
+            // Wake up the watcher thread so it can exit.
+            uint64_t one = 1;
+            (void)!write(stop_fd, &one, sizeof(one));
+            thread.join();
+        }
+    }
+
+    // Block until any of the watched files have changed, and no other
+    // changes have been made for the debounce duration, so that a burst
+    // of changes is returned together. Returns false if the watcher has
+    // been stopped.
+    bool wait_for_changes(std::chrono::milliseconds debounce = {}) {
+        std::unique_lock<std::mutex> lock(mutex);
+        condition.wait(lock, [this] { return !changes.empty() || stopped; });
+        while (!stopped && std::chrono::steady_clock::now() < last_change + debounce)
+            condition.wait_until(lock, last_change + debounce);
+        return !stopped;
+    }
+
+    // Get all the files that have changed since the last call.
+    std::vector<std::filesystem::path> take_changes() {
+        std::unique_lock<std::mutex> lock(mutex);
+        std::vector<std::filesystem::path> result;
+        result.swap(changes);
+        return result;
+    }
+
+private:
+    int inotify_fd = -1;
+    int stop_fd = -1;
+    std::thread thread;
+
+    // Mutex to synchronize access to the watched files and the changes.
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopped = false;
+    std::set<std::filesystem::path> files;
+    std::set<std::filesystem::path> watched_directories;
+    std::unordered_map<int, std::filesystem::path> directories;
+
+    // Files that have changed, in the order they were changed.
+    std::vector<std::filesystem::path> changes;
+    std::chrono::steady_clock::time_point last_change;
+};
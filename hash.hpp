@@ -0,0 +1,107 @@
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Implementation of the 64 bit xxHash (XXH64) algorithm, used to check
+// if the contents of a file have actually changed. The input is processed
+// in 32 byte stripes with four independent lanes, so it runs at memory speed.
+namespace xxh64 {
+    constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+    constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+    constexpr uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+    constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+    constexpr uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+    inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    inline uint64_t read64(const char* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+    inline uint32_t read32(const char* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+    inline uint64_t round(uint64_t acc, uint64_t input) {
+        acc += input * PRIME2;
+        return rotl(acc, 31) * PRIME1;
+    }
+
+    inline uint64_t merge_round(uint64_t acc, uint64_t value) {
+        acc ^= round(0, value);
+        return acc * PRIME1 + PRIME4;
+    }
+
+    inline uint64_t hash(const char* data, size_t length, uint64_t seed = 0) {
+        const char* p = data;
+        const char* end = data + length;
+        uint64_t h;
+
+        if (length >= 32) {
+            uint64_t v1 = seed + PRIME1 + PRIME2;
+            uint64_t v2 = seed + PRIME2;
+            uint64_t v3 = seed;
+            uint64_t v4 = seed - PRIME1;
+            do {
+                v1 = round(v1, read64(p));
+                v2 = round(v2, read64(p + 8));
+                v3 = round(v3, read64(p + 16));
+                v4 = round(v4, read64(p + 24));
+                p += 32;
+            } while (p + 32 <= end);
+
+            h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+            h = merge_round(h, v1);
+            h = merge_round(h, v2);
+            h = merge_round(h, v3);
+            h = merge_round(h, v4);
+        }
+        else {
+            h = seed + PRIME5;
+        }
+
+        h += length;
+        for (; p + 8 <= end; p += 8)
+            h = rotl(h ^ round(0, read64(p)), 27) * PRIME1 + PRIME4;
+        if (p + 4 <= end) {
+            h = rotl(h ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+            p += 4;
+        }
+        for (; p < end; ++p)
+            h = rotl(h ^ ((uint8_t)*p * PRIME5), 11) * PRIME1;
+
+        h ^= h >> 33;
+        h *= PRIME2;
+        h ^= h >> 29;
+        h *= PRIME3;
+        h ^= h >> 32;
+        return h;
+    }
+}
+
+// Hash the contents of the given file. Returns nothing if
+// the file could not be read.
+inline std::optional<uint64_t> hash_file(const std::filesystem::path& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return {};
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return {};
+    }
+
+    // Read the whole file in one go.
+    thread_local std::string buffer;
+    buffer.resize(st.st_size);
+    size_t size = 0;
+    while (size < buffer.size()) {
+        ssize_t n = read(fd, buffer.data() + size, buffer.size() - size);
+        if (n <= 0) break;
+        size += n;
+    }
+    close(fd);
+    return xxh64::hash(buffer.data(), size);
+}
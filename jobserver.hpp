@@ -0,0 +1,173 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// Client and server for the GNU make jobserver. When livecc is run by make
+// it takes its job tokens from make, and otherwise it hands out its own
+// tokens to the compilers it starts, so everything shares one job limit.
+// Every process has one implicit token, which is never in the pipe.
+class Jobserver {
+public:
+    // A job slot, which is given back when it is destroyed.
+    class Token {
+    public:
+        Token() = default;
+        Token(Token&& other) : jobserver(other.jobserver), token(other.token), implicit(other.implicit) {
+            other.jobserver = nullptr;
+        }
+        Token& operator=(Token&&) = delete;
+        ~Token() {
+            if (jobserver != nullptr)
+                jobserver->release(token, implicit);
+        }
+
+    private:
+        friend class Jobserver;
+        Token(Jobserver* jobserver, char token, bool implicit)
+            : jobserver(jobserver), token(token), implicit(implicit) {}
+
+        Jobserver* jobserver = nullptr;
+        char token = 0;
+        bool implicit = false;
+    };
+
+    ~Jobserver() {
+        if (owns_pipe) {
+            close(read_fd);
+            close(write_fd);
+        }
+    }
+
+    // Connect to the jobserver of make, if the MAKEFLAGS say there is one.
+    // Both the fifo (make 4.4) and the pipe style are supported.
+    bool connect() {
+        const char* makeflags = getenv("MAKEFLAGS");
+        if (makeflags == nullptr)
+            return false;
+
+        std::string_view flags(makeflags);
+        std::string_view auth;
+        size_t pos = 0;
+        while (pos < flags.size()) {
+            size_t end = flags.find(' ', pos);
+            if (end == std::string_view::npos)
+                end = flags.size();
+            std::string_view flag = flags.substr(pos, end - pos);
+            if (flag.starts_with("--jobserver-auth="))
+                auth = flag.substr(17);
+            else if (flag.starts_with("--jobserver-fds="))
+                auth = flag.substr(16);
+            else if (flag.starts_with("-j") && flag.size() > 2)
+                jobs = atoi(flag.data() + 2);
+            pos = end + 1;
+        }
+        if (auth.empty())
+            return false;
+
+        if (auth.starts_with("fifo:")) {
+            read_fd = write_fd = open(std::string(auth.substr(5)).c_str(), O_RDWR | O_CLOEXEC);
+        }
+        else {
+            // The pipe file descriptors are inherited from make, which closes
+            // them when the command isn't marked as recursive but keeps them
+            // in MAKEFLAGS. The numbers might then be used by other files.
+            size_t comma = auth.find(',');
+            if (comma == std::string_view::npos)
+                return false;
+            read_fd = atoi(std::string(auth.substr(0, comma)).c_str());
+            write_fd = atoi(std::string(auth.substr(comma + 1)).c_str());
+            if (!is_pipe(read_fd, write_fd))
+                read_fd = write_fd = -1;
+        }
+        return read_fd >= 0;
+    }
+
+    // Start a jobserver with the given number of jobs, and pass it to the
+    // child processes through MAKEFLAGS. This uses the pipe style, as
+    // that is understood by every version of make. The pipe is inherited
+    // by the child processes, so it isn't closed on exec.
+    bool serve(size_t job_count) {
+        int fds[2];
+        if (pipe(fds) != 0)
+            return false;
+        read_fd = fds[0];
+        write_fd = fds[1];
+        owns_pipe = true;
+        jobs = job_count > 0 ? job_count : 1;
+
+        std::string tokens(jobs - 1, '+');
+        if (!tokens.empty() && write(write_fd, tokens.data(), tokens.size()) != (ssize_t)tokens.size())
+            return false;
+
+        std::string makeflags = getenv("MAKEFLAGS") ? getenv("MAKEFLAGS") : "";
+        makeflags += " -j" + std::to_string(jobs) + " --jobserver-auth="
+            + std::to_string(read_fd) + ',' + std::to_string(write_fd);
+        setenv("MAKEFLAGS", makeflags.c_str(), 1);
+        return true;
+    }
+
+    // The number of jobs of the jobserver, or 0 if it is unknown.
+    size_t job_count() const { return jobs; }
+
+    // Wait for a job slot. Returns an empty token if there is no jobserver.
+    Token acquire() {
+        if (read_fd < 0)
+            return {};
+
+        bool expected = true;
+        if (implicit_free.compare_exchange_strong(expected, false))
+            return Token(this, 0, true);
+
+        char token;
+        while (true) {
+            ssize_t n = read(read_fd, &token, 1);
+            if (n == 1)
+                return Token(this, token, false);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EAGAIN) {
+                // Make sets the pipe to non-blocking, so wait for a token to become available.
+                pollfd fd { read_fd, POLLIN, 0 };
+                poll(&fd, 1, -1);
+                continue;
+            }
+            // The jobserver is gone, so just run without it.
+            return {};
+        }
+    }
+
+private:
+    int read_fd = -1;
+    int write_fd = -1;
+    bool owns_pipe = false;
+    size_t jobs = 0;
+    std::atomic<bool> implicit_free = true;
+
+    // Returns true if the file descriptors are the read and write end of the same pipe.
+    static bool is_pipe(int read_fd, int write_fd) {
+        struct stat read_stat, write_stat;
+        if (fstat(read_fd, &read_stat) != 0 || fstat(write_fd, &write_stat) != 0)
+            return false;
+        int read_mode = fcntl(read_fd, F_GETFL) & O_ACCMODE;
+        int write_mode = fcntl(write_fd, F_GETFL) & O_ACCMODE;
+        return S_ISFIFO(read_stat.st_mode) && S_ISFIFO(write_stat.st_mode)
+            && read_stat.st_dev == write_stat.st_dev && read_stat.st_ino == write_stat.st_ino
+            && read_mode != O_WRONLY && write_mode != O_RDONLY;
+    }
+
+    void release(char token, bool implicit) {
+        if (implicit) {
+            implicit_free.store(true);
+            return;
+        }
+        while (write(write_fd, &token, 1) < 0 && errno == EINTR) {}
+    }
+};
@@ -29,12 +29,29 @@
 #include <unordered_map>
 #include <set>
 #include <csignal>
+#include <shared_mutex>
+#include <deque>
+#include <queue>
+#include <chrono>
+#include <functional>
+#include <future>
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #include "thread_pool.hpp"
+#include "file_watcher.hpp"
+#include "hash.hpp"
+#include "dep_file.hpp"
+#include "p1689.hpp"
+#include "module_prefilter.hpp"
+#include "sharded_map.hpp"
+#include "jobserver.hpp"
+#include "resource_limiter.hpp"
+#include "spawn_server.hpp"
 
 // Sources: (order from bottom to top)
 // https://stackoverflow.com/questions/2694290/returning-a-shared-library-symbol-table
@@ -46,8 +63,6 @@
 // https://maskray.me/blog/2021-09-19-all-about-procedure-linkage-table
 // https://www.qnx.com/developers/docs/7.0.0/index.html#com.qnx.doc.neutrino.prog/topic/devel_Lazy_binding.html !
 
-// TODO: use inotify.
-
 
 namespace fs = std::filesystem;
 
@@ -57,6 +72,615 @@ enum build_type_t {
     STANDALONE,   // Build as an standalone executable.
 };
 
+// The state of the previous builds, stored in a single memory mapped binary
+// file. For every source and header it stores a content hash, so touching a
+// file or switching branches without changing it doesn't trigger a rebuild.
+// For every source file it stores the dependencies loaded from its .d and
+// .dm files, so these only have to be parsed again when they've changed.
+struct build_state_t {
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    struct file_t {
+        fs::file_time_type write_time;  // The write time when the hash was computed.
+        fs::file_time_type change_time; // The write time when the contents last changed.
+        uint64_t hash = 0;
+        bool hashed = false;
+    };
+
+    struct header_t {
+        uint32_t path;       // The canonical path of the header.
+        uint32_t dependency; // The path as added to the header_dependencies, or NONE.
+    };
+
+    struct unit_t {
+        bool has_modules = false;
+        fs::file_time_type modules_write_time; // Write time of the loaded .dm file.
+        uint32_t module_name = NONE;
+        std::vector<uint32_t> module_dependencies;
+
+        bool has_headers = false;
+        fs::file_time_type dependencies_write_time; // Write time of the loaded .d file.
+        std::vector<header_t> headers;
+
+        std::chrono::milliseconds compile_duration { 0 }; // Of the last compile, or 0 if unknown.
+        uint64_t peak_memory = 0; // In bytes, of the last compile, or 0 if unknown.
+    };
+
+    ~build_state_t() {
+        if (mapping != nullptr)
+            munmap(mapping, mapping_size);
+    }
+
+    // Returns the last time the contents of the file have changed. Throws
+    // a filesystem_error if the file does not exist.
+    fs::file_time_type get_change_time(const fs::path& path) {
+        std::string key = fs::absolute(path).lexically_normal().string();
+        fs::file_time_type write_time = fs::last_write_time(path);
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto it = ids.find(key);
+            if (it != ids.end() && files[it->second].hashed && files[it->second].write_time == write_time)
+                return files[it->second].change_time;
+        }
+
+        // The file has been written, so check if its contents changed.
+        std::optional<uint64_t> hash = hash_file(path);
+        if (!hash)
+            return write_time;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        file_t& file = files[intern(key)];
+        if (!file.hashed || file.hash != *hash) {
+            file.hash = *hash;
+            file.hashed = true;
+            file.change_time = write_time;
+        }
+        file.write_time = write_time;
+        return file.change_time;
+    }
+
+    // Get the stored module dependencies of the source, if they were
+    // loaded from a .dm file with the given write time.
+    bool load_modules(const fs::path& source, fs::file_time_type write_time,
+                      std::string_view& module_name, std::vector<std::string_view>& module_dependencies) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = ids.find(source.string());
+        if (it == ids.end()) return false;
+        auto unit = units.find(it->second);
+        if (unit == units.end() || !unit->second.has_modules || unit->second.modules_write_time != write_time)
+            return false;
+
+        if (unit->second.module_name != NONE)
+            module_name = strings[unit->second.module_name];
+        for (uint32_t module : unit->second.module_dependencies)
+            module_dependencies.push_back(strings[module]);
+        return true;
+    }
+
+    void store_modules(const fs::path& source, fs::file_time_type write_time,
+                       std::string_view module_name, const std::vector<std::string_view>& module_dependencies) {
+        std::unique_lock<std::mutex> lock(mutex);
+        unit_t& unit = units[intern(source.string())];
+        unit.has_modules = true;
+        unit.modules_write_time = write_time;
+        unit.module_name = module_name.empty() ? NONE : intern(module_name);
+        unit.module_dependencies.clear();
+        for (std::string_view module : module_dependencies)
+            unit.module_dependencies.push_back(intern(module));
+    }
+
+    // Get the stored header dependencies of the source, if they were loaded
+    // from a .d file with the given write time. Returns pairs of the canonical
+    // path and the dependency path (which is empty if it is not a dependency).
+    bool load_headers(const fs::path& source, fs::file_time_type write_time,
+                      std::vector<std::pair<std::string_view, std::string_view>>& headers) {
+        return load_headers(source, &write_time, headers);
+    }
+
+    // Get the headers that were stored for the source, even if its .d file has changed since.
+    bool load_last_headers(const fs::path& source, std::vector<std::pair<std::string_view, std::string_view>>& headers) {
+        return load_headers(source, nullptr, headers);
+    }
+
+    bool load_headers(const fs::path& source, const fs::file_time_type* write_time,
+                      std::vector<std::pair<std::string_view, std::string_view>>& headers) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = ids.find(source.string());
+        if (it == ids.end()) return false;
+        auto unit = units.find(it->second);
+        if (unit == units.end() || !unit->second.has_headers
+            || (write_time != nullptr && unit->second.dependencies_write_time != *write_time))
+            return false;
+
+        headers.reserve(unit->second.headers.size());
+        for (const header_t& header : unit->second.headers)
+            headers.emplace_back(strings[header.path],
+                header.dependency == NONE ? std::string_view() : strings[header.dependency]);
+        return true;
+    }
+
+    void store_headers(const fs::path& source, fs::file_time_type write_time,
+                       const std::vector<std::pair<std::string_view, std::string_view>>& headers) {
+        std::unique_lock<std::mutex> lock(mutex);
+        unit_t& unit = units[intern(source.string())];
+        unit.has_headers = true;
+        unit.dependencies_write_time = write_time;
+        unit.headers.clear();
+        for (auto& [path, dependency] : headers)
+            unit.headers.push_back({ intern(path), dependency.empty() ? NONE : intern(dependency) });
+    }
+
+    // Get how long the last compile of the source took, if it is known.
+    std::optional<std::chrono::milliseconds> get_compile_duration(const fs::path& source) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = ids.find(source.string());
+        if (it == ids.end()) return {};
+        auto unit = units.find(it->second);
+        if (unit == units.end() || unit->second.compile_duration.count() == 0)
+            return {};
+        return unit->second.compile_duration;
+    }
+
+    // Get the peak memory use of the last compile of the source, or 0 if it is unknown.
+    uint64_t get_peak_memory(const fs::path& source) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = ids.find(source.string());
+        if (it == ids.end()) return 0;
+        auto unit = units.find(it->second);
+        return unit == units.end() ? 0 : unit->second.peak_memory;
+    }
+
+    void store_compile_stats(const fs::path& source, std::chrono::milliseconds duration, uint64_t peak_memory) {
+        std::unique_lock<std::mutex> lock(mutex);
+        unit_t& unit = units[intern(source.string())];
+        unit.compile_duration = std::max(duration, std::chrono::milliseconds(1));
+        unit.peak_memory = peak_memory;
+    }
+
+    // Load the state from the given file. The stored dependencies are only
+    // used if they were created in the same working directory.
+    bool load(const fs::path& path, const fs::path& working_directory) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(disk_header_t)) {
+            close(fd);
+            return false;
+        }
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            return false;
+
+        // Validate the layout before using any of it.
+        const char* begin = (const char*)data;
+        size_t size = st.st_size;
+        const disk_header_t& header = *(const disk_header_t*)begin;
+        bool valid = memcmp(header.magic, MAGIC, sizeof(header.magic)) == 0
+            && header.version == VERSION
+            && header.string_count < size && header.unit_count < size && header.id_count < size
+            && header.chars_size < size
+            && sizeof(disk_header_t) + header.string_count * sizeof(disk_string_t)
+                + header.unit_count * sizeof(disk_unit_t) + header.id_count * sizeof(uint32_t)
+                + header.chars_size == size
+            && header.working_directory < header.string_count;
+
+        const disk_string_t* disk_strings = (const disk_string_t*)(begin + sizeof(disk_header_t));
+        const disk_unit_t* disk_units = (const disk_unit_t*)(disk_strings + header.string_count);
+        const uint32_t* disk_ids = (const uint32_t*)(disk_units + header.unit_count);
+        const char* chars = (const char*)(disk_ids + header.id_count);
+
+        // The offsets are checked before the lengths are added, so a corrupted offset can't wrap around.
+        for (size_t i = 0; valid && i < header.string_count; ++i)
+            valid = disk_strings[i].offset <= header.chars_size
+                && disk_strings[i].length <= header.chars_size - disk_strings[i].offset;
+        for (size_t i = 0; valid && i < header.unit_count; ++i) {
+            const disk_unit_t& u = disk_units[i];
+            valid = u.source < header.string_count
+                && (u.module_name == NONE || u.module_name < header.string_count)
+                && u.ids_offset <= header.id_count
+                && u.module_count + 2 * (uint64_t)u.header_count <= header.id_count - u.ids_offset;
+        }
+        for (size_t i = 0; valid && i < header.id_count; ++i)
+            valid = disk_ids[i] == NONE || disk_ids[i] < header.string_count;
+        if (!valid) {
+            munmap(data, size);
+            return false;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        mapping = data;
+        mapping_size = size;
+
+        // The strings point directly into the mapped file.
+        strings.reserve(header.string_count);
+        files.reserve(header.string_count);
+        ids.reserve(header.string_count);
+        for (size_t i = 0; i < header.string_count; ++i) {
+            const disk_string_t& s = disk_strings[i];
+            strings.emplace_back(chars + s.offset, s.length);
+            files.push_back({
+                fs::file_time_type(fs::file_time_type::duration(s.write_time)),
+                fs::file_time_type(fs::file_time_type::duration(s.change_time)),
+                s.hash, s.hashed != 0 });
+            ids.emplace(strings.back(), i);
+        }
+
+        if (strings[header.working_directory] != working_directory.string())
+            return true;
+
+        toolchain_fingerprint = header.toolchain_fingerprint;
+
+        for (size_t i = 0; i < header.unit_count; ++i) {
+            const disk_unit_t& u = disk_units[i];
+            unit_t& unit = units[u.source];
+            unit.has_modules = u.has_modules;
+            unit.modules_write_time = fs::file_time_type(fs::file_time_type::duration(u.modules_write_time));
+            unit.module_name = u.module_name;
+            unit.module_dependencies.assign(disk_ids + u.ids_offset, disk_ids + u.ids_offset + u.module_count);
+            unit.has_headers = u.has_headers;
+            unit.dependencies_write_time = fs::file_time_type(fs::file_time_type::duration(u.dependencies_write_time));
+            const uint32_t* header_ids = disk_ids + u.ids_offset + u.module_count;
+            unit.headers.resize(u.header_count);
+            for (uint32_t j = 0; j < u.header_count; ++j)
+                unit.headers[j] = { header_ids[2 * j], header_ids[2 * j + 1] };
+            unit.compile_duration = std::chrono::milliseconds(u.compile_duration);
+            unit.peak_memory = u.peak_memory;
+        }
+        return true;
+    }
+
+    // Set the fingerprint of the toolchain. The stored headers are split into
+    // system headers and dependencies using the toolchain, so they are dropped
+    // if it has changed, which makes the .d files be parsed again.
+    void set_toolchain(uint64_t fingerprint) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (fingerprint == toolchain_fingerprint)
+            return;
+        toolchain_fingerprint = fingerprint;
+        for (auto& [source, unit] : units) {
+            unit.has_headers = false;
+            unit.headers.clear();
+        }
+    }
+
+    void save(const fs::path& path, const fs::path& working_directory) {
+        std::unique_lock<std::mutex> lock(mutex);
+        disk_header_t header {};
+        memcpy(header.magic, MAGIC, sizeof(header.magic));
+        header.version = VERSION;
+        header.working_directory = intern(working_directory.string());
+        header.toolchain_fingerprint = toolchain_fingerprint;
+
+        std::vector<disk_string_t> disk_strings;
+        std::string chars;
+        disk_strings.reserve(strings.size());
+        for (size_t i = 0; i < strings.size(); ++i) {
+            disk_strings.push_back({ chars.size(), (uint32_t)strings[i].size(), files[i].hashed, files[i].hash,
+                files[i].write_time.time_since_epoch().count(), files[i].change_time.time_since_epoch().count() });
+            chars += strings[i];
+        }
+
+        std::vector<disk_unit_t> disk_units;
+        std::vector<uint32_t> disk_ids;
+        disk_units.reserve(units.size());
+        for (auto& [source, unit] : units) {
+            disk_units.push_back({ source, unit.module_name, unit.has_modules, unit.has_headers,
+                unit.modules_write_time.time_since_epoch().count(),
+                unit.dependencies_write_time.time_since_epoch().count(),
+                disk_ids.size(), (uint32_t)unit.module_dependencies.size(), (uint32_t)unit.headers.size(),
+                unit.compile_duration.count(), unit.peak_memory });
+            disk_ids.insert(disk_ids.end(), unit.module_dependencies.begin(), unit.module_dependencies.end());
+            for (const header_t& h : unit.headers) {
+                disk_ids.push_back(h.path);
+                disk_ids.push_back(h.dependency);
+            }
+        }
+
+        header.string_count = disk_strings.size();
+        header.unit_count = disk_units.size();
+        header.id_count = disk_ids.size();
+        header.chars_size = chars.size();
+
+        // Write to a temporary file first, as the old one might still be mapped.
+        fs::path temporary_path = fs::path(path) += ".tmp";
+        {
+            std::ofstream f(temporary_path, std::ios::binary);
+            f.write((const char*)&header, sizeof(header));
+            f.write((const char*)disk_strings.data(), disk_strings.size() * sizeof(disk_string_t));
+            f.write((const char*)disk_units.data(), disk_units.size() * sizeof(disk_unit_t));
+            f.write((const char*)disk_ids.data(), disk_ids.size() * sizeof(uint32_t));
+            f.write(chars.data(), chars.size());
+        }
+        fs::rename(temporary_path, path);
+    }
+
+private:
+    static constexpr char MAGIC[4] = { 'L', 'V', 'C', 'C' };
+    static constexpr uint32_t VERSION = 4;
+
+    struct disk_header_t {
+        char magic[4];
+        uint32_t version;
+        uint64_t string_count;
+        uint64_t unit_count;
+        uint64_t id_count;
+        uint64_t chars_size;
+        uint32_t working_directory;
+        uint32_t padding;
+        uint64_t toolchain_fingerprint;
+    };
+
+    struct disk_string_t {
+        uint64_t offset;
+        uint32_t length;
+        uint32_t hashed;
+        uint64_t hash;
+        int64_t write_time;
+        int64_t change_time;
+    };
+
+    struct disk_unit_t {
+        uint32_t source;
+        uint32_t module_name;
+        uint32_t has_modules;
+        uint32_t has_headers;
+        int64_t modules_write_time;
+        int64_t dependencies_write_time;
+        uint64_t ids_offset;   // Module dependencies followed by header pairs.
+        uint32_t module_count;
+        uint32_t header_count;
+        int64_t compile_duration; // In milliseconds.
+        uint64_t peak_memory;     // In bytes.
+    };
+
+    std::mutex mutex;
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+
+    // Interned strings (paths and module names), which either
+    // point into the mapped file or into owned_strings.
+    std::vector<std::string_view> strings;
+    std::vector<file_t> files;
+    std::unordered_map<std::string_view, uint32_t> ids;
+    std::deque<std::string> owned_strings;
+
+    // source path -> unit.
+    std::unordered_map<uint32_t, unit_t> units;
+    // Of the toolchain with which the headers of the units were stored.
+    uint64_t toolchain_fingerprint = 0;
+
+    // The mutex must be locked.
+    uint32_t intern(std::string_view s) {
+        auto it = ids.find(s);
+        if (it != ids.end())
+            return it->second;
+        std::string_view owned = owned_strings.emplace_back(s);
+        uint32_t id = strings.size();
+        strings.push_back(owned);
+        files.emplace_back();
+        ids.emplace(owned, id);
+        return id;
+    }
+};
+
+// Table of all the dependency paths and module names, so they can be
+// referred to by a 32 bit id. A header that is included by thousands of
+// files is then only stored once, and the dependencies of a file are a
+// small sorted array. Ids are never removed.
+struct path_table_t {
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    uint32_t intern(std::string_view path) {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto it = ids.find(path);
+            if (it != ids.end())
+                return it->second;
+        }
+
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto it = ids.find(path);
+        if (it != ids.end())
+            return it->second;
+        // The paths don't move when the deque grows, so the keys stay valid.
+        uint32_t id = paths.size();
+        ids.emplace(paths.emplace_back(path).native(), id);
+        return id;
+    }
+
+    // Returns NONE if the path has never been interned.
+    uint32_t find(std::string_view path) {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto it = ids.find(path);
+        return it == ids.end() ? NONE : it->second;
+    }
+
+    const fs::path& operator[](uint32_t id) {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return paths[id];
+    }
+
+    size_t size() {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return paths.size();
+    }
+
+private:
+    std::shared_mutex mutex;
+    std::deque<fs::path> paths;
+    std::unordered_map<std::string_view, uint32_t> ids;
+};
+
+// The system include directories of the compiler, as it reports them with
+// -v. The headers in these only change when the toolchain is updated, so
+// instead of checking each of them for changes, only the fingerprint of
+// the toolchain is checked: the hash of the compiler binary and the write
+// times of the include directories.
+struct toolchain_t {
+    // Canonical paths, ending with a '/'.
+    std::vector<std::string> system_include_dirs;
+    // Every header in the system include directories changed at this time.
+    fs::file_time_type change_time;
+    // False if the include directories could not be found, in which case
+    // every header is checked for changes.
+    bool detected = false;
+    // Changes when the compiler, its arguments or its include directories change.
+    uint64_t fingerprint = 0;
+
+    // Load the stored toolchain from the given file, and detect it again if
+    // the toolchain has changed since. The compiler is only run when the
+    // fingerprint doesn't match.
+    void load(const fs::path& path, const std::string& compiler, const std::string& arguments,
+              build_state_t& build_state) {
+        uint64_t stored_fingerprint = 0;
+        int64_t stored_change_time = 0;
+        std::ifstream in(path);
+        if (in >> stored_fingerprint >> stored_change_time) {
+            in.ignore();
+            std::string dir;
+            while (std::getline(in, dir))
+                system_include_dirs.push_back(dir);
+        }
+
+        fingerprint = get_fingerprint(compiler, arguments, build_state);
+        if (system_include_dirs.empty() || fingerprint != stored_fingerprint) {
+            detect(compiler, arguments);
+            fingerprint = get_fingerprint(compiler, arguments, build_state);
+        }
+        detected = !system_include_dirs.empty();
+
+        if (detected && fingerprint == stored_fingerprint) {
+            change_time = fs::file_time_type(fs::file_time_type::duration(stored_change_time));
+            return;
+        }
+
+        // The toolchain has changed, so everything that uses it is outdated.
+        change_time = fs::file_time_type::clock::now();
+        if (!detected) {
+            // Fall back to the usual location of the system headers.
+            system_include_dirs = { "/usr/" };
+            return;
+        }
+        std::ofstream out(path);
+        out << fingerprint << ' ' << change_time.time_since_epoch().count() << '\n';
+        for (const std::string& dir : system_include_dirs)
+            out << dir << '\n';
+    }
+
+    // Returns true if the canonical path is in one of the system include directories.
+    bool is_system_header(std::string_view path) const {
+        for (const std::string& dir : system_include_dirs)
+            if (path.starts_with(dir))
+                return true;
+        return false;
+    }
+
+    // Returns true if the header can only change with the toolchain. This is not
+    // the case for /usr/local, as the headers in there are installed by the user.
+    bool is_immutable(std::string_view path) const {
+        return detected && is_system_header(path) && !path.starts_with("/usr/local/");
+    }
+
+private:
+    uint64_t get_fingerprint(const std::string& compiler, const std::string& arguments, build_state_t& build_state) {
+        std::string key = arguments;
+        try {
+            // The change time only changes with the hash of the binary.
+            fs::path binary = fs::canonical(compiler);
+            key += '\0' + binary.string() + '\0'
+                + std::to_string(build_state.get_change_time(binary).time_since_epoch().count());
+        }
+        catch (const fs::filesystem_error&) {}
+
+        std::error_code ec;
+        for (const std::string& dir : system_include_dirs)
+            key += '\0' + dir + '\0' + std::to_string(fs::last_write_time(dir, ec).time_since_epoch().count());
+        return xxh64::hash(key.data(), key.size());
+    }
+
+    // Get the system include directories from the search list the compiler prints with -v.
+    void detect(const std::string& compiler, const std::string& arguments) {
+        system_include_dirs.clear();
+        std::string cmd = compiler + arguments + " -x c++ -E -v /dev/null -o /dev/null 2>&1";
+        FILE* pipe = popen(cmd.c_str(), "r");
+        if (!pipe)
+            return;
+        std::array<char, 4096> buffer;
+        std::string output;
+        size_t n;
+        while ((n = fread(buffer.data(), 1, buffer.size(), pipe)) > 0)
+            output.append(buffer.data(), n);
+        pclose(pipe);
+
+        size_t start = output.find("#include <...> search starts here:\n");
+        size_t end = output.find("End of search list.", start);
+        if (start == std::string::npos || end == std::string::npos)
+            return;
+        std::istringstream lines(output.substr(start, end - start));
+        std::string line;
+        std::getline(lines, line);
+        while (std::getline(lines, line)) {
+            // Lines are like " /usr/include" or " /Library/Frameworks (framework directory)".
+            size_t begin = line.find_first_not_of(' ');
+            if (begin == std::string::npos)
+                continue;
+            std::string dir = line.substr(begin, line.find(" (", begin) - begin);
+            std::error_code ec;
+            fs::path canonical = fs::canonical(dir, ec);
+            if (!ec)
+                system_include_dirs.push_back((canonical / "").string());
+        }
+    }
+};
+
+// Caches how the paths in the .d files resolve, as the same headers are
+// in the dependencies of almost every file. Resolving a path takes
+// multiple syscalls, while a lookup here is only a shared lock.
+struct path_cache_t {
+    struct resolved_t {
+        fs::path canonical;
+        uint32_t dependency; // The id of the path as added to the header_dependencies, or NONE.
+        bool system_header;  // If it should be compiled as a system header unit.
+    };
+
+    // Resolve the path as written in a .d file. Throws a
+    // filesystem_error if the file does not exist.
+    const resolved_t& resolve(std::string_view path, const fs::path& working_directory,
+                              const toolchain_t& toolchain, path_table_t& path_table) {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto it = paths.find(path);
+            if (it != paths.end())
+                return it->second;
+        }
+
+        resolved_t resolved { fs::canonical(path), path_table_t::NONE, false };
+        if (!toolchain.is_system_header(resolved.canonical.native())) {
+            // Is a relative path so add it to the dependencies.
+            resolved.dependency = path_table.intern(fs::relative(resolved.canonical, working_directory).native());
+        }
+        else if (!resolved.canonical.has_extension()) {
+            resolved.dependency = path_table.intern(resolved.canonical.native());
+            resolved.system_header = true;
+        }
+
+        // References to the elements stay valid when the map grows.
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        return paths.emplace(path, std::move(resolved)).first->second;
+    }
+
+private:
+    struct string_hash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+    };
+
+    std::shared_mutex mutex;
+    std::unordered_map<std::string, resolved_t, string_hash, std::equal_to<>> paths;
+};
+
 struct dll_t {
     fs::path working_directory;
     fs::path output_file;
@@ -65,22 +689,55 @@ struct dll_t {
     fs::path modules_directory;
 
     build_type_t build_type = LIVE;
+    std::string compiler = "/usr/bin/clang";
     std::string build_command;
+    // The arguments that change the system include directories.
+    std::string toolchain_arguments;
     std::vector<std::string_view> build_include_dirs;
 
     bool include_source_parent_dir = true;
     bool rebuild_with_O0 = false;
 
+    // Only scan the files that might use modules. The header dependencies
+    // of the other files are taken from the .d file written by the compile.
+    // Only the source itself is checked for module declarations, so this
+    // can't be used if a header that is included as text imports a module.
+    bool scan_modules_only = false;
+
+    // The file names of the precompiled headers given on the command line.
+    std::set<std::string, std::less<>> pch_file_names;
+
+    // Keep compiling the files that don't depend on a file that failed to
+    // compile, instead of stopping at the first error.
+    bool keep_going = false;
+
     std::string link_arguments;
 
     // The amount of files to compile in parallel.
     int job_count = 0;
 
+    // Shares the job limit with make and the compilers.
+    Jobserver jobserver;
+    // Limits the compiles by the available memory.
+    ResourceLimiter limiter;
+    // Starts the compilers, so the host application isn't forked.
+    SpawnServer spawner;
+
+    // How long to wait for more changes before reloading.
+    std::chrono::milliseconds reload_debounce { 100 };
+
+    build_state_t build_state;
+    toolchain_t toolchain;
+    path_table_t path_table;
+    path_cache_t path_cache;
+
     // Runtime.
     link_map* handle;
     plthook_t* plthook;
     std::vector<void*> loaded_handles;
     std::vector<fs::path> temporary_files;
+    std::atomic<size_t> temporary_files_count = 0;
+    std::mutex temporary_files_mutex;
 
 private:
     std::mutex print_mutex;
@@ -142,12 +799,49 @@ private:
     }
 };
 
+// Split a shell command into its arguments, handling quotes and escapes.
+std::vector<std::string> split_command(std::string_view command) {
+    std::vector<std::string> arguments;
+    std::string argument;
+    bool in_argument = false;
+    char quote = 0;
+    for (size_t i = 0; i < command.size(); ++i) {
+        char c = command[i];
+        if (quote != 0) {
+            if (c == quote) quote = 0;
+            else if (c == '\\' && quote == '"' && i + 1 < command.size()) argument += command[++i];
+            else argument += c;
+        }
+        else if (c == '"' || c == '\'') {
+            quote = c;
+            in_argument = true;
+        }
+        else if (c == '\\' && i + 1 < command.size()) {
+            argument += command[++i];
+            in_argument = true;
+        }
+        else if (c == ' ' || c == '\t' || c == '\n') {
+            if (in_argument)
+                arguments.push_back(std::move(argument));
+            argument.clear();
+            in_argument = false;
+        }
+        else {
+            argument += c;
+            in_argument = true;
+        }
+    }
+    if (in_argument)
+        arguments.push_back(std::move(argument));
+    return arguments;
+}
+
 struct init_data_t {
     // Store the library header file file times here, so we
     // don't have to keep checking them for changes.
-    std::unordered_map<fs::path, fs::file_time_type> file_changes;
-    std::mutex mutex;
-    std::set<fs::path> system_headers;
+    ShardedMap<fs::path, fs::file_time_type> file_changes;
+    // System header -> its file time.
+    ShardedMap<fs::path, fs::file_time_type> system_headers;
 };
 
 
@@ -176,8 +870,9 @@ struct source_file_t {
     // should also be added to the source files with the header unit type
     std::string module_name; // if type == MODULE.
 
-    std::set<fs::path> header_dependencies;
-    std::set<std::string> module_dependencies;
+    // Sorted ids of the paths and module names in dll.path_table.
+    std::vector<uint32_t> header_dependencies;
+    std::vector<uint32_t> module_dependencies;
     std::string build_pch_includes; // pch includes to add to the build command.
 
     // RUNTIME:
@@ -189,6 +884,13 @@ struct source_file_t {
     std::atomic<int> compiled_dependencies; // When this is equal to dependencies_count, we can compile.
     int dependencies_count = 0;
 
+    // Milliseconds it takes to compile this file and the longest chain of
+    // files that depend on it. Files with the highest priority go first.
+    int64_t priority = 0;
+
+    // The scan was skipped, so the header dependencies must be loaded after compiling.
+    bool scan_skipped = false;
+
     source_file_t(dll_t& dll, const fs::path& path, type_t type = UNIT)
         : dll(dll), source_path(path),
           type(type == UNIT && source_path.extension().string().starts_with(".h") ? PCH : type) {}
@@ -204,22 +906,33 @@ struct source_file_t {
         module_dependencies = std::move(lhs.module_dependencies);
         build_pch_includes = std::move(lhs.build_pch_includes);
         dependent_files = std::move(lhs.dependent_files);
+        scan_skipped = lhs.scan_skipped;
     }
 
-    // Returns true if it must be compiled.
-    bool load_dependencies(init_data_t& init_data) {
-        compiled_path = (dll.output_directory / source_path);
-        if (typeIsPCH())
-            compiled_path += ".gch";
-        else
-            compiled_path.replace_extension(".o");
+    enum load_result_t {
+        UP_TO_DATE,
+        MUST_COMPILE,
+        MUST_SCAN, // The .d and .dm files must be created first.
+    };
+
+    // Load the dependencies from the .d and .dm files. If these are missing
+    // or outdated, MUST_SCAN is returned, after which the dependency files
+    // should be created and this function called again with scanned = true.
+    load_result_t load_dependencies(init_data_t& init_data, bool scanned = false) {
+        if (!scanned) {
+            compiled_path = (dll.output_directory / source_path);
+            if (typeIsPCH())
+                compiled_path += ".gch";
+            else
+                compiled_path.replace_extension(".o");
+        }
 
-        fs::path dependencies_path = fs::path(compiled_path).replace_extension(".d");
-        fs::path modules_path = fs::path(compiled_path).replace_extension(".dm");
+        fs::path dependencies_path = get_dependencies_path();
+        fs::path modules_path = get_modules_path();
 
-        if (!fs::exists(dependencies_path) || !fs::exists(modules_path))
+        if (!scanned && (!fs::exists(dependencies_path) || !fs::exists(modules_path)))
             // .d and/or the .md file does not exist, so create it.
-            create_dependency_files(dependencies_path, modules_path);
+            return must_scan(init_data);
 
         // Load the module dependency file, which also determines if this file is a module.
         load_module_dependencies(modules_path);
@@ -233,68 +946,125 @@ struct source_file_t {
         // If one of the sources was changed after the dependencies, or
         // one of the sources doesn't exist anymore, we have to update
         // the dependency files.
-        if (!sources_edit_time || fs::last_write_time(dependencies_path) < *sources_edit_time) {
-            create_dependency_files(dependencies_path, modules_path);
-            load_module_dependencies(modules_path);
-            sources_edit_time = load_header_dependencies(dependencies_path, init_data);
+        std::error_code ec;
+        if (!sources_edit_time || fs::last_write_time(dependencies_path, ec) < *sources_edit_time || ec) {
+            if (!scanned)
+                return must_scan(init_data);
 
             // Dependencies could not be loaded, so just recompile.
             if (!sources_edit_time)
-                return true;
+                return MUST_COMPILE;
         }
 
         // The sources have been changed, so recompile.
         if (!last_write_time || *last_write_time < *sources_edit_time) {
             last_write_time = *sources_edit_time;
-            return true;
+            return MUST_COMPILE;
         }
 
-        return false;
+        return UP_TO_DATE;
     }
 
+    fs::path get_dependencies_path() const { return fs::path(compiled_path).replace_extension(".d"); }
+    fs::path get_modules_path() const { return fs::path(compiled_path).replace_extension(".dm"); }
+
 private:
-    void create_dependency_files(const fs::path& dependencies_path, const fs::path& modules_path) {
-        dll.log_info("Creating dependencies for", source_path);
+    // Returns MUST_SCAN, unless the scan can be skipped because this is a
+    // plain unit that doesn't use modules. Then its .d file is written when
+    // it is compiled, and it gets an empty .dm file.
+    load_result_t must_scan(init_data_t& init_data) {
+        if (!dll.scan_modules_only || type != UNIT || has_module_extension())
+            return MUST_SCAN;
+        // Both checks only need the source itself, which is read once.
+        thread_local std::string content;
+        if (!read_file(source_path, content) || may_declare_modules(content) || may_include_pch(content))
+            return MUST_SCAN;
+
+        // The other dependencies come from the compile.
+        load_last_header_units(init_data);
         fs::create_directories(compiled_path.parent_path());
+        std::ofstream module_dependencies(get_modules_path());
+        p1689::write(module_dependencies, {});
+        scan_skipped = true;
+        return MUST_COMPILE;
+    }
 
-        std::string cmd = "clang-scan-deps -format=p1689 -- " + get_build_command() + " -MF \"" + dependencies_path.string() + "\"";
-        std::array<char, 256> buffer;
-        FILE* pipe = popen(cmd.c_str(), "r");
-        if (!pipe) {
-            throw std::runtime_error("popen() failed!");
-        }
-        std::ofstream module_dependencies(modules_path);
-        while (fgets(buffer.data(), (int)buffer.size(), pipe) != nullptr) {
-            module_dependencies << buffer.data();
+    // Returns false if the source doesn't mention the file name of one of the
+    // precompiled headers, so it can't include them directly. Without a scan
+    // the file wouldn't wait for them.
+    bool may_include_pch(std::string_view content) const {
+        for (const std::string& name : dll.pch_file_names)
+            if (content.find(name) != std::string_view::npos)
+                return true;
+        return false;
+    }
+
+    // Use the system header units of the last compile of the source, so it
+    // still waits for them and uses them without a scan. A header the source
+    // no longer includes is still included, which system headers allow. A
+    // source that was never compiled includes them as text until the next build.
+    void load_last_header_units(init_data_t& init_data) {
+        header_dependencies.clear();
+        std::vector<std::pair<std::string_view, std::string_view>> headers;
+        if (!dll.build_state.load_last_headers(source_path, headers))
+            return;
+
+        std::vector<std::pair<fs::path, fs::file_time_type>> system_headers;
+        for (auto& [header, dependency] : headers) {
+            if (dependency.empty() || dependency != header)
+                continue;
+            try {
+                system_headers.emplace_back(header, get_header_change_time(header, init_data));
+            }
+            catch (const fs::filesystem_error&) {
+                continue;
+            }
+            header_dependencies.push_back(dll.path_table.intern(dependency));
         }
-        pclose(pipe);
+        sort_ids(header_dependencies);
+        init_data.system_headers.insert(std::move(system_headers));
+    }
+
+    // Returns true if the extension is one that is only used for modules.
+    bool has_module_extension() const {
+        static constexpr std::string_view module_extensions[] = { ".cppm", ".ixx", ".mpp", ".cxxm", ".c++m", ".ccm" };
+        std::string extension = source_path.extension().string();
+        return std::find(std::begin(module_extensions), std::end(module_extensions), extension) != std::end(module_extensions);
     }
 
     // Load the modules .md file.
     void load_module_dependencies(const fs::path& path) {
         module_name.clear();
         module_dependencies.clear();
-        std::ifstream f(path);
-        std::string line;
-        enum { NONE, PROVIDES, REQUIRES } state;
-        while (std::getline(f, line)) {
-            std::string_view l(line);
-            l = l.substr(l.find('"') + 1);
-            if (l.starts_with("provides"))
-                state = PROVIDES;
-            else if (l.starts_with("requires"))
-                state = REQUIRES;
-            else if (l.starts_with("logical-name")) {
-                l = l.substr(13); // skip `logical-name"`
-                l = l.substr(l.find('"') + 1);
-                l = l.substr(0, l.find('"'));
-                if (state == PROVIDES)
-                    module_name = l;
-                else if (state == REQUIRES)
-                    module_dependencies.emplace(l);
+
+        // Use the stored module dependencies if the file hasn't changed since.
+        std::error_code ec;
+        fs::file_time_type write_time = fs::last_write_time(path, ec);
+        std::string_view name;
+        std::vector<std::string_view> modules;
+        thread_local std::string content;
+        if (ec || !dll.build_state.load_modules(source_path, write_time, name, modules)) {
+            std::vector<p1689::rule_t> rules;
+            if (read_file(path, content) && p1689::parser_t(content).parse(rules)) {
+                for (const p1689::rule_t& rule : rules) {
+                    if (!rule.provides.empty())
+                        name = rule.provides[0].logical_name;
+                    for (const p1689::module_t& module : rule.imports) {
+                        // TODO: add support for header units.
+                        if (module.lookup_method == "by-name")
+                            modules.push_back(module.logical_name);
+                    }
+                }
             }
+            if (!ec)
+                dll.build_state.store_modules(source_path, write_time, name, modules);
         }
 
+        module_name = name;
+        for (std::string_view module : modules)
+            module_dependencies.push_back(dll.path_table.intern(module));
+        sort_ids(module_dependencies);
+
         // Turn this unit in a module.
         if (!module_name.empty() && type == UNIT) {
             compiled_path.replace_extension(".pcm");
@@ -302,90 +1072,124 @@ private:
         }
     }
 
+    static void sort_ids(std::vector<uint32_t>& ids) {
+        std::sort(ids.begin(), ids.end());
+        ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+    }
+
+    // Get the last change time of the header, and cache it for the other files.
+    fs::file_time_type get_header_change_time(const fs::path& header, init_data_t& init_data) {
+        if (dll.toolchain.is_immutable(header.native()))
+            return dll.toolchain.change_time;
+        return init_data.file_changes.get_or_insert(header, [&] { return dll.build_state.get_change_time(header); });
+    }
+
     std::optional<fs::file_time_type> load_header_dependencies(const fs::path& path, init_data_t& init_data) {
         header_dependencies.clear();
-        fs::file_time_type sources_edit_time = fs::last_write_time(source_path);
-        std::ifstream f(path);
-        std::vector<char> str;
-        bool is_good; char c;
-        do {
-            is_good = f.good();
-            if (!is_good || (c = f.get()) == ' ' || c == '\n' || c == EOF) {
-                // End of file, so push it.
-                if (str.size() == 0) continue;
+        fs::file_time_type sources_edit_time = dll.build_state.get_change_time(source_path);
+
+        // Use the stored dependencies if the .d file hasn't changed since.
+        std::error_code ec;
+        fs::file_time_type write_time = fs::last_write_time(path, ec);
+        // The system headers are added to the init data in one go at the end.
+        std::vector<std::pair<fs::path, fs::file_time_type>> system_headers;
+
+        std::vector<std::pair<std::string_view, std::string_view>> stored_headers;
+        if (!ec && dll.build_state.load_headers(source_path, write_time, stored_headers)) {
+            for (auto& [header, dependency] : stored_headers) {
+                fs::file_time_type change_time;
                 try {
-                    // While initialising, check if any file has changed. We
-                    // use a map for efficiency.
-                    fs::path s = fs::canonical(std::string_view{&str[0], str.size()});
-                    std::unique_lock<std::mutex> lock(init_data.mutex);
-                    auto it = init_data.file_changes.find(s);
-                    if (it == init_data.file_changes.end())
-                        it = init_data.file_changes.emplace_hint(it, s, fs::last_write_time(s));
-                    if (it->second > sources_edit_time)
-                        sources_edit_time = it->second;
-
-                    bool system_header = str.size() > 4 && str[0] == '/' && str[1] == 'u' && str[2] == 's' && str[3] == 'r' && str[4] == '/';
-                    if (!system_header) {
-                        // Is a relative path so add it to the dependencies.
-                        header_dependencies.insert(fs::relative(s, dll.working_directory));
-                    }
-                    else if (!s.has_extension()) {
-                        header_dependencies.insert(s);
-                        init_data.system_headers.insert(s);
-                    }
+                    change_time = get_header_change_time(header, init_data);
+                    if (change_time > sources_edit_time)
+                        sources_edit_time = change_time;
                 }
                 catch (const fs::filesystem_error&) {
-                    // File does not exist anymore, which mean we
-                    // need to rebuild the dependencies.
                     return {};
                 }
-                str.clear();
-            }
-            else if (c == '\\') {
-                char d = f.get();
-                if (d == ' ') str.push_back(' ');
+
+                if (!dependency.empty()) {
+                    header_dependencies.push_back(dll.path_table.intern(dependency));
+                    if (dependency == header)
+                        system_headers.emplace_back(header, change_time);
+                }
             }
-            else if (c == ':')  str.clear();
-            else str.push_back(c);
-        } while (is_good);
+            sort_ids(header_dependencies);
+            init_data.system_headers.insert(std::move(system_headers));
+            return sources_edit_time;
+        }
 
+        // (canonical path, dependency path) of every header, to store in the build state.
+        std::vector<std::pair<std::string_view, std::string_view>> headers;
+        thread_local std::string content;
+        if (!read_file(path, content))
+            content.clear();
+        bool loaded = parse_dep_file(content, [&] (std::string_view str) {
+            try {
+                // While initialising, check if any file has changed. We
+                // use a map for efficiency.
+                const path_cache_t::resolved_t& header
+                    = dll.path_cache.resolve(str, dll.working_directory, dll.toolchain, dll.path_table);
+                fs::file_time_type change_time = get_header_change_time(header.canonical, init_data);
+                if (change_time > sources_edit_time)
+                    sources_edit_time = change_time;
+
+                std::string_view dependency;
+                if (header.dependency != path_table_t::NONE) {
+                    header_dependencies.push_back(header.dependency);
+                    dependency = dll.path_table[header.dependency].native();
+                }
+                if (header.system_header)
+                    system_headers.emplace_back(header.canonical, change_time);
+                headers.emplace_back(header.canonical.native(), dependency);
+            }
+            catch (const fs::filesystem_error&) {
+                // File does not exist anymore, which mean we
+                // need to rebuild the dependencies.
+                return false;
+            }
+            return true;
+        });
+        if (!loaded)
+            return {};
+
+        sort_ids(header_dependencies);
+        init_data.system_headers.insert(std::move(system_headers));
+        if (!ec)
+            dll.build_state.store_headers(source_path, write_time, headers);
         return sources_edit_time;
     }
 
 
 public:
-    bool has_source_changed() {
-        if (typeIsPCH())
-            return false;
-        try {
-            fs::file_time_type new_write_time = fs::last_write_time(source_path);
-            if (!last_write_time || *last_write_time < new_write_time) {
-                std::cout << source_path << " changed!\n";
-                last_write_time = new_write_time;
-                return true;
-            }
-        }
-        catch (const fs::filesystem_error&) {
+    // Returns true if the source or one of the headers it depends on was
+    // changed at the given time, after this file was last compiled.
+    bool has_source_changed(fs::file_time_type new_write_time) {
+        if (!last_write_time || *last_write_time < new_write_time) {
+            last_write_time = new_write_time;
             return true;
         }
         return false;
+    }
 
-        // bool changed = false;
-        // for (const fs::path& p : header_dependencies) {
-        //     try {
-        //         fs::file_time_type new_write_time = fs::last_write_time(p);
-        //         if (new_write_time > last_edit_time) {
-        //             std::cout << p << " changed!\n";
-        //             last_edit_time = new_write_time;
-        //             changed = true;
-        //             return true;
-        //         }
-        //     }
-        //     catch (const fs::filesystem_error&) {
-        //         changed = true;
-        //     }
-        // }
-        // return changed;
+    // Load the header dependencies from the .d file written by the last
+    // compile. Returns the previous dependencies, or nothing if the new
+    // ones could not be loaded.
+    std::optional<std::vector<uint32_t>> reload_header_dependencies() {
+        fs::path dependencies_path = fs::path(latest_dll).replace_extension(".d");
+        if (!fs::exists(dependencies_path))
+            return {};
+
+        init_data_t init_data;
+        std::vector<uint32_t> previous = std::move(header_dependencies);
+        bool loaded = load_header_dependencies(dependencies_path, init_data).has_value();
+        if (latest_dll != compiled_path)
+            fs::remove(dependencies_path);
+
+        if (!loaded) {
+            header_dependencies = std::move(previous);
+            return {};
+        }
+        return previous;
     }
 
     std::string get_build_command(bool live_compile = false, fs::path* output_path = nullptr) {
@@ -409,7 +1213,7 @@ public:
         bool create_temporary_object = live_compile && output_path != nullptr && type == UNIT;
         *output_path = !create_temporary_object ? compiled_path
             : dll.output_directory / "tmp"
-                / ("tmp" + (std::to_string(dll.temporary_files.size()) + ".so"));
+                / ("tmp" + (std::to_string(dll.temporary_files_count++) + ".so"));
 
         // Include the parent dir of every file.
         if (dll.include_source_parent_dir) {
@@ -444,6 +1248,15 @@ public:
 
     // Returns true if an error occurred.
     bool compile(bool live_compile = false) {
+        std::promise<bool> error;
+        start_compile(live_compile, [&] (bool compile_error) { error.set_value(compile_error); });
+        return error.get_future().get();
+    }
+
+    // Start compiling the file, without waiting for the compiler. done is
+    // called with true if an error occurred, from the thread that waits for
+    // the compilers, so it should return quickly.
+    void start_compile(bool live_compile, std::function<void(bool error)> done) {
         fs::path output_path;
         std::string build_command = get_build_command(live_compile, &output_path);
 
@@ -455,14 +1268,47 @@ public:
             h << "#pragma once\n#include <" << compiled_path.filename().string() << ">\n";
         }
 
-        // Run the command, and exit when interrupted.
-        int err = system(build_command.c_str());
+        // Wait until there is enough memory for the compile, and a job token.
+        // They are kept until the compiler has exited.
+        struct budget_t {
+            ResourceLimiter::Slot slot;
+            Jobserver::Token token;
+        };
+        auto budget = std::make_shared<budget_t>(budget_t {
+            dll.limiter.acquire(dll.build_state.get_peak_memory(source_path)),
+            dll.jobserver.acquire() });
+
+        auto start_time = std::chrono::steady_clock::now();
+        dll.spawner.start_process(split_command(build_command),
+            [this, live_compile, output_path, start_time, budget, done = std::move(done)]
+            (int err, uint64_t peak_memory) mutable {
+                budget.reset();
+                done(finish_compile(live_compile, output_path, start_time, err, peak_memory));
+            },
+            // This is called before the exit, while the budget is still kept.
+            [running = budget.get()] (pid_t pid) { running->slot.set_pid(pid); });
+    }
+
+    // Handle the exit of the compiler. Returns true if an error occurred.
+    bool finish_compile(bool live_compile, const fs::path& output_path,
+                        std::chrono::steady_clock::time_point start_time, int err, uint64_t peak_memory) {
+        // Exit when interrupted.
         if (WIFSIGNALED(err) && (WTERMSIG(err) == SIGINT || WTERMSIG(err) == SIGQUIT))
             exit(1);
 
+        // Remember how long it took and how much memory it used, to schedule the next build.
+        if (err == 0) {
+            dll.limiter.observe(peak_memory);
+            if (!live_compile)
+                dll.build_state.store_compile_stats(source_path,
+                    std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time),
+                    peak_memory);
+        }
+
         latest_dll = output_path;
 
         if (live_compile) {
+            std::unique_lock<std::mutex> lock(dll.temporary_files_mutex);
             dll.temporary_files.push_back(latest_dll);
         }
 
@@ -481,10 +1327,11 @@ public:
         return false;
     }
 
-    void replace_functions() {
-        link_map* handle = (link_map*)dlopen(latest_dll.c_str(), RTLD_LAZY | RTLD_GLOBAL | RTLD_DEEPBIND);
+    // Patch the functions of the given library into the application.
+    void replace_functions(const fs::path& library) {
+        link_map* handle = (link_map*)dlopen(library.c_str(), RTLD_LAZY | RTLD_GLOBAL | RTLD_DEEPBIND);
         if (handle == nullptr) {
-            dll.log_info("Error loading", latest_dll);
+            dll.log_info("Error loading", library);
             return;
         }
 
@@ -535,14 +1382,35 @@ typedef int set_callback_func_t(dll_callback_func_t*);
 struct live_cc_t {
     dll_t dll;
 
-    size_t path_index = 0;
     std::vector<source_file_t> files;
 
+    // Runs the work of every phase, from the scans to the live recompiles.
+    // It is never destroyed, so a task can exit() without joining its own thread.
+    ThreadPool* pool = nullptr;
+
+    // Watches the source files for changes during a live session.
+    FileWatcher watcher;
+    std::unordered_map<fs::path, source_file_t*> watched_files;
+
+    // header id -> files that include it.
+    std::unordered_map<uint32_t, std::vector<source_file_t*>> header_dependents;
+
+    // Compiles the changed files in the background. The libraries that
+    // are ready to be patched in are stored in reloaded_libraries.
+    std::thread reload_thread;
+    std::mutex reload_mutex;
+    std::vector<std::pair<source_file_t*, fs::path>> reloaded_libraries;
+    std::atomic<bool> reload_ready = false;
+
+    // Files of a reload that failed to compile. These are compiled
+    // again with the next changes, as reloads are all or nothing.
+    std::set<source_file_t*> failed_files;
+
     void parse_arguments(int argn, char** argv) {
         dll.working_directory = fs::current_path();
         dll.output_file = "build/a.out";
         std::ostringstream build_command;
-        build_command << "/usr/bin/clang ";
+        build_command << dll.compiler << ' ';
 
         enum { INPUT, OUTPUT, PCH, FLAG } next_arg_type = INPUT;
 
@@ -586,8 +1454,18 @@ struct live_cc_t {
                     dll.build_type = SHARED;
                 else if (arg == "--no-rebuild-with-O0")
                     dll.rebuild_with_O0 = false;
+                else if (arg.starts_with("--debounce="))
+                    dll.reload_debounce = std::chrono::milliseconds(std::stoi(argv[i] + 11));
+                else if (arg == "--scan-modules-only")
+                    dll.scan_modules_only = true;
+                else if (arg == "--keep-going")
+                    dll.keep_going = true;
                 else {
                     build_command << ' ' << arg;
+                    for (std::string_view flag : { "--sysroot", "-isysroot", "-stdlib", "--gcc-toolchain",
+                                                   "--gcc-install-dir", "--target", "-nostdinc", "-nostdlibinc" })
+                        if (arg.starts_with(flag))
+                            dll.toolchain_arguments += ' ' + std::string(arg);
 
                     // The next argument is part of this flag, so it's not a file.
                     // TODO: handle all the arguments in which you specify an option.
@@ -610,6 +1488,10 @@ struct live_cc_t {
             }
         }
 
+        for (source_file_t& f : files)
+            if (f.typeIsPCH())
+                dll.pch_file_names.insert(f.source_path.filename().native());
+
         // Set the output directory.
         dll.output_directory = dll.output_file.parent_path();
         switch (dll.build_type) {
@@ -644,23 +1526,46 @@ struct live_cc_t {
             build_command << " -fno-inline";// -fno-ipa-sra";
         // -fno-ipa-sra disables removal of unused parameters, as this breaks code recompiling for functions with unused arguments for some reason.
         build_command << " -MD -Winvalid-pch";
+        // The output of the compilers goes through a pipe, so they can't see the terminal themselves.
+        if (isatty(STDERR_FILENO))
+            build_command << " -fdiagnostics-color=always";
 
         dll.build_command = build_command.str();
+
+        // Take the job tokens from make if it runs us, and otherwise
+        // hand them out to the compilers ourselves.
+        bool connected = dll.jobserver.connect();
+        if (connected && dll.job_count == 0)
+            dll.job_count = dll.jobserver.job_count();
+        // Use the CPUs we can actually use, instead of all of them.
+        if (dll.job_count == 0)
+            dll.job_count = resources::cpu_count();
+        if (!connected)
+            dll.jobserver.serve(dll.job_count);
+        dll.limiter.set_job_limit(dll.job_count);
+
+        // Fork the spawn server while this process is still small, and before
+        // the threads are started. It inherits the MAKEFLAGS and job tokens.
+        if (!dll.spawner.start())
+            dll.log_error("Could not start the spawn server, so the compilers are started from this process");
+        // The compilers run without a thread waiting for them, so the threads
+        // are only needed for the work done by this process.
+        pool = new ThreadPool(std::min<size_t>(dll.job_count, resources::cpu_count()));
     }
 
     bool compile_files(std::string name, const std::vector<source_file_t*>& to_compile) {
         if (to_compile.size() > 0) {
             dll.log_set_task("COMPILING " + name, to_compile.size());
-            ThreadPool pool(dll.job_count);
+            TaskGroup group;
             for (source_file_t* f : to_compile)
-                pool.enqueue([this, f] {
+                pool->enqueue(group, [this, f] {
                     bool error = f->compile();
                     dll.log_step_task();
                     return error;
                 });
-            pool.join();
+            pool->wait(group);
             dll.log_clear_task();
-            return !pool.got_error;
+            return !group.got_error();
         }
         return true;
     }
@@ -693,90 +1598,265 @@ struct live_cc_t {
         }
     }
 
-    bool compile_files(std::set<source_file_t*>& to_compile) {
+    bool compile_files(std::set<source_file_t*>& to_compile, init_data_t& init_data) {
         dll.log_set_task("COMPILING", to_compile.size());
-        ThreadPool pool(dll.job_count);
+        set_compile_priorities(to_compile);
+        failed_count = 0;
+        compiled_count = 0;
+        TaskGroup group;
 
         // Add all files that have no dependencies to the compile queue.
         // As these compile they will add all the other files too.
         for (source_file_t& f : files) {
             if (f.dependencies_count == 0) {
-                add_to_compile_queue(pool, to_compile, &f);
+                add_to_compile_queue(group, to_compile, init_data, &f);
             }
         }
 
-        pool.join();
+        pool->wait(group);
         dll.log_clear_task();
+
+        // The files that depend on a file that failed are never added to the queue.
+        if (failed_count > 0) {
+            size_t skipped = to_compile.size() - failed_count - compiled_count;
+            if (dll.keep_going)
+                dll.log_error(failed_count.load(), "files failed to compile, and", skipped,
+                              "files that depend on them were skipped");
+            else
+                dll.log_error(failed_count.load(), "files failed to compile, and", skipped,
+                              "files were not compiled. Use --keep-going to compile the files that don't depend on them");
+            return false;
+        }
         return true;
     }
 
 private:
-    void mark_compiled(ThreadPool& pool, const std::set<source_file_t*>& to_compile, source_file_t* f) {
+    // Files that are ready to be compiled, with the highest priority on top.
+    // Files with the same priority are compiled in the order of files.
+    std::mutex ready_mutex;
+    std::priority_queue<std::tuple<int64_t, ptrdiff_t, source_file_t*>> ready_files;
+
+    // The files that failed to compile and that compiled in the current build.
+    std::atomic<size_t> failed_count = 0;
+    std::atomic<size_t> compiled_count = 0;
+
+    // Set the priority of the files to the longest path through the files that
+    // depend on them, using how long the files took to compile the last time.
+    // Files that aren't compiled count as 0, and files that were never
+    // compiled as the average.
+    void set_compile_priorities(const std::set<source_file_t*>& to_compile) {
+        std::unordered_map<source_file_t*, int64_t> durations;
+        int64_t total = 0;
+        for (source_file_t* f : to_compile) {
+            std::optional<std::chrono::milliseconds> duration = dll.build_state.get_compile_duration(f->source_path);
+            if (duration) {
+                durations.emplace(f, duration->count());
+                total += duration->count();
+            }
+        }
+        int64_t average = durations.empty() ? 1 : total / durations.size();
+        for (source_file_t* f : to_compile)
+            durations.try_emplace(f, average);
+
+        for (source_file_t& f : files)
+            f.priority = -1;
+        auto visit = [&] (auto& visit, source_file_t* f) -> int64_t {
+            if (f->priority >= 0)
+                return f->priority;
+            f->priority = 0; // In case the graph has a cycle.
+            int64_t longest = 0;
+            for (source_file_t* d : f->dependent_files)
+                longest = std::max(longest, visit(visit, d));
+            auto it = durations.find(f);
+            return f->priority = longest + (it != durations.end() ? it->second : 0);
+        };
+        for (source_file_t& f : files)
+            visit(visit, &f);
+    }
+
+    void mark_compiled(TaskGroup& group, const std::set<source_file_t*>& to_compile,
+                       init_data_t& init_data, source_file_t* f) {
         for (source_file_t* d : f->dependent_files) {
             if (++d->compiled_dependencies == d->dependencies_count) {
-                add_to_compile_queue(pool, to_compile, d);
+                add_to_compile_queue(group, to_compile, init_data, d);
             }
         }
     }
 
-    void add_to_compile_queue(ThreadPool& pool,
-                              const std::set<source_file_t*>& to_compile, source_file_t* f) {
+    void add_to_compile_queue(TaskGroup& group, const std::set<source_file_t*>& to_compile,
+                              init_data_t& init_data, source_file_t* f) {
         if (to_compile.contains(f)) {
-            pool.enqueue([this, &pool, &to_compile, f] {
-                bool error = f->compile();
-                if (!error)
-                    mark_compiled(pool, to_compile, f);
-                dll.log_step_task();
-                return error;
+            {
+                std::unique_lock<std::mutex> lock(ready_mutex);
+                ready_files.emplace(f->priority, files.data() - f, f);
+            }
+            // Every task compiles the ready file with the highest priority,
+            // which isn't necessarily the one that was just added.
+            pool->enqueue(group, [this, &group, &to_compile, &init_data] {
+                source_file_t* f;
+                {
+                    std::unique_lock<std::mutex> lock(ready_mutex);
+                    f = std::get<2>(ready_files.top());
+                    ready_files.pop();
+                }
+                // Stop at the first error, like the pool did before it was shared.
+                // Only --keep-going starts new compiles after an error.
+                if (group.got_error() && !dll.keep_going)
+                    return false;
+
+                // The compiler runs without a thread waiting for it, and the group
+                // is kept open until the file is marked as compiled.
+                pool->hold(group);
+                f->start_compile(false, [this, &group, &to_compile, &init_data, f] (bool error) {
+                    pool->enqueue(group, [this, &group, &to_compile, &init_data, f, error] {
+                        if (error)
+                            ++failed_count;
+                        else {
+                            ++compiled_count;
+                            // The file now has a .d file, so load the dependencies it skipped the scan for.
+                            if (f->scan_skipped)
+                                f->load_dependencies(init_data, true);
+                            mark_compiled(group, to_compile, init_data, f);
+                        }
+                        dll.log_step_task();
+                        return error;
+                    });
+                    pool->release(group);
+                });
+                return false;
             });
         }
         else {
             // We don't need to compile this file, so add its dependencies to the queue.
-            mark_compiled(pool, to_compile, f);
+            mark_compiled(group, to_compile, init_data, f);
+        }
+    }
+
+    // Add the header dependencies of the files for which the scan was skipped,
+    // which were loaded from the .d files written by their compile.
+    void add_skipped_dependencies() {
+        for (source_file_t& f : files) {
+            if (!f.scan_skipped)
+                continue;
+            f.scan_skipped = false;
+            // The system header units from the last compile were already added.
+            for (uint32_t header : f.header_dependencies) {
+                std::vector<source_file_t*>& dependents = header_dependents[header];
+                if (std::find(dependents.begin(), dependents.end(), &f) == dependents.end())
+                    dependents.push_back(&f);
+            }
+        }
+    }
+
+    // Create the .d and .dm files of all the given files with a single
+    // clang-scan-deps run, so they share its file system caches.
+    void create_dependency_files(const std::vector<source_file_t*>& to_scan) {
+        dll.log_info("Creating dependencies for", to_scan.size(), "files");
+
+        // Write a compilation database with all the files to scan.
+        fs::path database_path = dll.output_directory / "scan_commands.json";
+        {
+            std::ofstream database(database_path);
+            database << "[\n";
+            for (size_t i = 0; i < to_scan.size(); ++i) {
+                source_file_t* f = to_scan[i];
+                fs::create_directories(f->compiled_path.parent_path());
+                std::string command = f->get_build_command() + " -MF \"" + f->get_dependencies_path().string() + "\"";
+                database << "  { \"directory\": " << json_quote(dll.working_directory.string())
+                         << ", \"file\": " << json_quote(f->source_path.string())
+                         << ", \"output\": " << json_quote(f->compiled_path.string())
+                         << ", \"command\": " << json_quote(command) << " }"
+                         << (i + 1 < to_scan.size() ? ",\n" : "\n");
+            }
+            database << "]\n";
+        }
+
+        size_t job_count = dll.job_count > 0 ? dll.job_count : std::thread::hardware_concurrency();
+        std::string cmd = "clang-scan-deps -format=p1689 -j " + std::to_string(job_count)
+            + " -compilation-database=\"" + database_path.string() + "\"";
+        std::array<char, 4096> buffer;
+        FILE* pipe = popen(cmd.c_str(), "r");
+        if (!pipe) {
+            throw std::runtime_error("popen() failed!");
+        }
+        std::string output;
+        size_t n;
+        while ((n = fread(buffer.data(), 1, buffer.size(), pipe)) > 0)
+            output.append(buffer.data(), n);
+        pclose(pipe);
+
+        // Split the rules in the output per file, using their primary output.
+        std::vector<p1689::rule_t> rules;
+        if (!p1689::parser_t(output).parse(rules))
+            dll.log_error("Could not parse the output of clang-scan-deps");
+        std::unordered_map<std::string_view, const p1689::rule_t*> rule_map;
+        for (const p1689::rule_t& rule : rules)
+            rule_map.emplace(rule.primary_output, &rule);
+
+        for (source_file_t* f : to_scan) {
+            std::ofstream module_dependencies(f->get_modules_path());
+            auto it = rule_map.find(f->compiled_path.string());
+            if (it != rule_map.end())
+                p1689::write(module_dependencies, { *it->second });
+            else
+                p1689::write(module_dependencies, {});
         }
     }
 
     bool create_dependency_tree() {
-        // module name -> source file
-        std::map<std::string, source_file_t*> module_map;
-        std::map<fs::path, source_file_t*> header_map;
+        // Interning the names of the headers and modules here makes sure
+        // all ids are known, so the maps can be indexed by the ids.
+        std::vector<uint32_t> module_ids(files.size(), path_table_t::NONE);
+        std::vector<uint32_t> header_ids(files.size(), path_table_t::NONE);
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (files[i].type == source_file_t::MODULE)
+                module_ids[i] = dll.path_table.intern(files[i].module_name);
+            else if (files[i].typeIsPCH())
+                header_ids[i] = dll.path_table.intern(files[i].source_path.native());
+        }
 
-        for (source_file_t& f : files) {
-            if (f.type == source_file_t::MODULE) {
-                auto it = module_map.find(f.module_name);
-                if (it == module_map.end())
-                    module_map.emplace_hint(it, f.module_name, &f);
+        // module name id -> source file
+        std::vector<source_file_t*> module_map(dll.path_table.size(), nullptr);
+        // header id -> source file
+        std::vector<source_file_t*> header_map(dll.path_table.size(), nullptr);
+
+        for (size_t i = 0; i < files.size(); ++i) {
+            source_file_t& f = files[i];
+            if (module_ids[i] != path_table_t::NONE) {
+                source_file_t*& module = module_map[module_ids[i]];
+                if (module == nullptr)
+                    module = &f;
                 else {
                     dll.log_error("There are multiple implementations for module ", f.module_name,
-                        "(", it->second->source_path, "and", f.source_path, ")");
+                        "(", module->source_path, "and", f.source_path, ")");
                     return false;
                 }
             }
-            else if (f.typeIsPCH()) {
-                header_map.emplace(f.source_path, &f);
+            else if (header_ids[i] != path_table_t::NONE && header_map[header_ids[i]] == nullptr) {
+                header_map[header_ids[i]] = &f;
             }
         }
 
         // Fill the dependent_files of each module, e.g.
         // the files that depend on that module.
         for (source_file_t& f : files) {
-            for (const fs::path& header : f.header_dependencies) {
-                auto it = header_map.find(header);
-                if (it != header_map.end() && &f != it->second) {
-                    it->second->dependent_files.push_back(&f);
+            for (uint32_t header : f.header_dependencies) {
+                header_dependents[header].push_back(&f);
+                source_file_t* pch = header_map[header];
+                if (pch != nullptr && &f != pch) {
+                    pch->dependent_files.push_back(&f);
                     ++f.dependencies_count;
                     if (f.type == source_file_t::SYSTEM_PCH)
-                        f.build_pch_includes += " -include \"" + it->second->compiled_path.replace_extension().string() + '"';
-                    f.build_pch_includes += " -include-pch \"" + it->second->compiled_path.string() + '"';
+                        f.build_pch_includes += " -include \"" + pch->compiled_path.replace_extension().string() + '"';
+                    f.build_pch_includes += " -include-pch \"" + pch->compiled_path.string() + '"';
                 }
             }
-            for (const std::string& module : f.module_dependencies) {
-                auto it = module_map.find(module);
-                if (it == module_map.end()) {
-                    dll.log_error("Error in", f.source_path, ": module", module, "does not exist");
+            for (uint32_t module : f.module_dependencies) {
+                if (module_map[module] == nullptr) {
+                    dll.log_error("Error in", f.source_path, ": module", dll.path_table[module].string(), "does not exist");
                     return false;
                 }
-                it->second->dependent_files.push_back(&f);
+                module_map[module]->dependent_files.push_back(&f);
                 ++f.dependencies_count;
             }
         }
@@ -792,34 +1872,66 @@ public:
         {
             std::set<source_file_t*> modules_to_compile;
             std::set<source_file_t*> files_to_compile;
+            init_data_t init_data;
 
             {
                 std::vector<size_t> modules_to_compile_i;
                 std::vector<size_t> files_to_compile_i;
 
-                init_data_t init_data;
+                dll.build_state.load(dll.output_directory / "build_state", dll.working_directory);
+                dll.toolchain.load(dll.output_directory / "toolchain", dll.compiler, dll.toolchain_arguments, dll.build_state);
+                dll.build_state.set_toolchain(dll.toolchain.fingerprint);
                 dll.log_set_task("LOADING DEPENDENCIES", files.size());
-                ThreadPool pool(dll.job_count);
-                for (size_t i = 0; i < files.size(); ++i)
-                    pool.enqueue([&, i] () {
-                        source_file_t& file = files[i];
-                        if (file.load_dependencies(init_data)) {
-                            std::unique_lock<std::mutex> lock(init_data.mutex);
-                            files_to_compile_i.push_back(i);
-                            if (file.type == source_file_t::MODULE)
-                                modules_to_compile_i.push_back(i);
-                        }
+                // Every task writes only to its own result, so this needs no locking.
+                std::vector<source_file_t::load_result_t> results(files.size());
+                auto load_dependencies = [&] (size_t i, bool scanned) {
+                    results[i] = files[i].load_dependencies(init_data, scanned);
+                    if (results[i] != source_file_t::MUST_SCAN)
                         dll.log_step_task();
-                        return false;
-                    });
-                pool.join();
+                    return false;
+                };
+                {
+                    TaskGroup group;
+                    for (size_t i = 0; i < files.size(); ++i)
+                        pool->enqueue(group, [&, i] { return load_dependencies(i, false); });
+                    pool->wait(group);
+                }
+
+                // Scan all the files with missing or outdated dependencies at once, and load them again.
+                std::vector<source_file_t*> files_to_scan;
+                for (size_t i = 0; i < files.size(); ++i)
+                    if (results[i] == source_file_t::MUST_SCAN)
+                        files_to_scan.push_back(&files[i]);
+                size_t skipped = std::count_if(files.begin(), files.end(), [] (source_file_t& f) { return f.scan_skipped; });
+                if (skipped > 0)
+                    dll.log_info("Skipped the dependency scan of", skipped, "files without modules");
+                if (!files_to_scan.empty()) {
+                    create_dependency_files(files_to_scan);
+                    TaskGroup group;
+                    for (source_file_t* f : files_to_scan)
+                        pool->enqueue(group, [&, i = f - files.data()] { return load_dependencies(i, true); });
+                    pool->wait(group);
+                }
                 dll.log_clear_task();
+                dll.build_state.save(dll.output_directory / "build_state", dll.working_directory);
+
+                for (size_t i = 0; i < files.size(); ++i) {
+                    if (results[i] == source_file_t::MUST_COMPILE) {
+                        files_to_compile_i.push_back(i);
+                        if (files[i].type == source_file_t::MODULE)
+                            modules_to_compile_i.push_back(i);
+                    }
+                }
 
                 // Create system header compilation units and mark them for recompilation if necessary.
-                for (const fs::path& header_path : init_data.system_headers) {
+                std::map<fs::path, fs::file_time_type> system_headers;
+                init_data.system_headers.for_each([&] (const fs::path& header_path, fs::file_time_type change_time) {
+                    system_headers.emplace(header_path, change_time);
+                });
+                for (auto& [header_path, change_time] : system_headers) {
                     source_file_t& f = files.emplace_back(dll, header_path, source_file_t::SYSTEM_PCH);
                     f.compiled_path = dll.output_directory / "system" / (header_path.filename().string() + ".gch");
-                    if (!fs::exists(f.compiled_path) || fs::last_write_time(f.compiled_path) < init_data.file_changes[header_path])
+                    if (!fs::exists(f.compiled_path) || fs::last_write_time(f.compiled_path) < change_time)
                         files_to_compile_i.push_back(files.size() - 1);
                 }
 
@@ -836,7 +1948,14 @@ public:
             did_compilation = !files_to_compile.empty();
 
             // Compile all the modules headers.
-            if (!compile_files(files_to_compile))
+            bool compiled = compile_files(files_to_compile, init_data);
+
+            // The files that weren't scanned have loaded their .d file after their compile.
+            add_skipped_dependencies();
+            // Also stores the compile durations. This is also done when some files failed,
+            // so the ones that did compile are remembered for the next build.
+            dll.build_state.save(dll.output_directory / "build_state", dll.working_directory);
+            if (!compiled)
                 return false;
         }
 
@@ -854,7 +1973,9 @@ public:
 
             dll.log_info("Linking sources together...");
             // std::cout << link_command.str() << std::endl;
-            if (int err = system(link_command.str().c_str())) {
+            Jobserver::Token token = dll.jobserver.acquire();
+            uint64_t peak_memory;
+            if (int err = dll.spawner.run(split_command(link_command.str()), peak_memory)) {
                 dll.log_error("Error linking to", dll.output_file, ':', err);
                 return false;
             }
@@ -865,6 +1986,27 @@ public:
     }
 
     void start( dll_callback_func_t* callback_func ) {
+        // Start watching the source files and their headers for changes.
+        for (source_file_t& file : files) {
+            if (file.type == source_file_t::SYSTEM_PCH)
+                continue;
+            fs::path path = file.source_path.lexically_normal();
+            if (!watcher.watch(path))
+                dll.log_error("Could not watch", file.source_path, "for changes");
+            watched_files.emplace(path, &file);
+
+            for (uint32_t id : file.header_dependencies) {
+                const fs::path& header = dll.path_table[id];
+                if (header.is_relative() && !watcher.watch(header))
+                    dll.log_error("Could not watch", header, "for changes");
+            }
+        }
+        watcher.start();
+        reload_thread = std::thread([this] {
+            while (watcher.wait_for_changes(dll.reload_debounce))
+                reload(watcher.take_changes());
+        });
+
         // Open the created shared library.
         dll.handle = (link_map *)dlopen(dll.output_file.c_str(), RTLD_LAZY | RTLD_GLOBAL);
         if (dll.handle == nullptr)
@@ -887,6 +2029,9 @@ public:
             (*main_func)(0, nullptr);
 
         dll.log_info("Ending live reload session");
+        watcher.stop();
+        reload_thread.join();
+        dll.build_state.save(dll.output_directory / "build_state", dll.working_directory);
         close();
 
         plthook_close(dll.plthook);
@@ -909,14 +2054,115 @@ public:
         files.clear();
     }
 
+    // Called from the application, so this should never block. We only
+    // patch in the libraries that have been compiled by the reload thread.
     void update() {
-        path_index = (path_index + 1) % files.size();
+        if (!reload_ready.load(std::memory_order_acquire))
+            return;
+
+        std::vector<std::pair<source_file_t*, fs::path>> libraries;
+        {
+            std::unique_lock<std::mutex> lock(reload_mutex);
+            libraries.swap(reloaded_libraries);
+            reload_ready.store(false, std::memory_order_relaxed);
+        }
+        for (auto& [file, library] : libraries)
+            file->replace_functions(library);
+    }
+
+private:
+    // Recompile the files affected by the given changes on the
+    // reload thread, and hand them over to update() when done.
+    void reload(const std::vector<fs::path>& changes) {
+        // Find all the files that are affected by the changes.
+        std::set<source_file_t*> changed_files;
+        changed_files.swap(failed_files);
+        for (const fs::path& path : changes) {
+            fs::file_time_type write_time;
+            try {
+                write_time = dll.build_state.get_change_time(path);
+            }
+            catch (const fs::filesystem_error&) {
+                continue;
+            }
+
+            dll.log_info(path, "changed!");
+            auto it = watched_files.find(path);
+            if (it != watched_files.end() && it->second->has_source_changed(write_time))
+                changed_files.insert(it->second);
+
+            auto dependents = header_dependents.find(dll.path_table.find(path.native()));
+            if (dependents != header_dependents.end())
+                for (source_file_t* f : dependents->second)
+                    if (f->has_source_changed(write_time))
+                        changed_files.insert(f);
+        }
+
+        if (changed_files.empty())
+            return;
+
+        // Precompiled headers are included by the other files, so build them first.
+        std::vector<source_file_t*> headers;
+        std::vector<source_file_t*> units;
+        for (source_file_t* f : changed_files) {
+            if (f->typeIsPCH()) headers.push_back(f);
+            else units.push_back(f);
+        }
+        if (!compile_files("HEADERS", headers)) {
+            failed_files = std::move(changed_files);
+            return;
+        }
+
+        // TODO: only recompile the actual function that has been changed.
+        std::vector<char> errors(units.size());
+        std::vector<std::optional<std::vector<uint32_t>>> previous_dependencies(units.size());
+        {
+            TaskGroup group;
+            for (size_t i = 0; i < units.size(); ++i)
+                pool->enqueue(group, [&, i] {
+                    errors[i] = units[i]->compile(true);
+                    if (!errors[i])
+                        previous_dependencies[i] = units[i]->reload_header_dependencies();
+                    return false;
+                });
+            pool->wait(group);
+        }
+
+        // The includes of the files might have changed, so update the reverse dependencies.
+        for (size_t i = 0; i < units.size(); ++i)
+            if (previous_dependencies[i])
+                update_header_dependents(units[i], *previous_dependencies[i]);
+
+        // Don't patch in only part of the changes, so the application
+        // never runs with half of them. Try again with the next change.
+        if (std::find(errors.begin(), errors.end(), true) != errors.end()) {
+            dll.log_error("Not reloading, as not all changed files compiled");
+            failed_files = std::move(changed_files);
+            return;
+        }
+
+        // Patch them all in at once the next time update() is called.
+        std::unique_lock<std::mutex> lock(reload_mutex);
+        for (source_file_t* f : units)
+            reloaded_libraries.emplace_back(f, f->latest_dll);
+        reload_ready.store(!reloaded_libraries.empty(), std::memory_order_release);
+    }
 
-        source_file_t& file = files[path_index];
-        if (file.has_source_changed()) {
-            // TODO: only recompile the actual function that has been changed.
-            file.compile(true);
-            file.replace_functions();
+    void update_header_dependents(source_file_t* f, const std::vector<uint32_t>& previous) {
+        // Both are sorted, so the differences can be found in one pass.
+        std::vector<uint32_t> removed, added;
+        std::set_difference(previous.begin(), previous.end(),
+            f->header_dependencies.begin(), f->header_dependencies.end(), std::back_inserter(removed));
+        std::set_difference(f->header_dependencies.begin(), f->header_dependencies.end(),
+            previous.begin(), previous.end(), std::back_inserter(added));
+
+        for (uint32_t header : removed)
+            std::erase(header_dependents[header], f);
+
+        for (uint32_t header : added) {
+            header_dependents[header].push_back(f);
+            if (dll.path_table[header].is_relative())
+                watcher.watch(dll.path_table[header]);
         }
     }
 };
@@ -0,0 +1,180 @@
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+// Quick check if a source file might declare or import a module, so the
+// files that don't can skip the module dependency scan. Module and import
+// declarations must be at the start of a line, so only the line starts
+// outside of comments and string literals are checked.
+namespace module_prefilter {
+    inline bool is_identifier(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+    }
+
+    inline bool is_special(char c) {
+        return c == '\n' || c == '/' || c == '"' || c == '\'' || c == '\\';
+    }
+
+    // Find the first character at or after pos that can start or end a
+    // comment, literal or line. Uses SSE2 to check 16 characters at a time
+    // where available.
+    inline size_t find_special(const char* data, size_t pos, size_t size) {
+#ifdef __SSE2__
+        const __m128i newline = _mm_set1_epi8('\n');
+        const __m128i slash = _mm_set1_epi8('/');
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i apostrophe = _mm_set1_epi8('\'');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        for (; pos + 16 <= size; pos += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(data + pos));
+            __m128i m = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, newline), _mm_cmpeq_epi8(v, slash)),
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, apostrophe)),
+                             _mm_cmpeq_epi8(v, backslash)));
+            int mask = _mm_movemask_epi8(m);
+            if (mask != 0)
+                return pos + __builtin_ctz(mask);
+        }
+#endif
+        for (; pos < size; ++pos)
+            if (is_special(data[pos]))
+                return pos;
+        return size;
+    }
+
+    // Returns the position after the word if the content has it at pos.
+    inline size_t match_word(std::string_view content, size_t pos, std::string_view word) {
+        if (content.compare(pos, word.size(), word) != 0)
+            return std::string_view::npos;
+        pos += word.size();
+        if (pos < content.size() && is_identifier(content[pos]))
+            return std::string_view::npos;
+        return pos;
+    }
+
+    inline size_t skip_spaces(std::string_view content, size_t pos) {
+        while (pos < content.size() && (content[pos] == ' ' || content[pos] == '\t'))
+            ++pos;
+        return pos;
+    }
+
+    // Returns true if the line starting at pos starts with a
+    // module or import declaration, which may be exported.
+    inline bool is_declaration(std::string_view content, size_t pos) {
+        pos = skip_spaces(content, pos);
+        size_t after_export = match_word(content, pos, "export");
+        if (after_export != std::string_view::npos)
+            pos = skip_spaces(content, after_export);
+        return match_word(content, pos, "module") != std::string_view::npos
+            || match_word(content, pos, "import") != std::string_view::npos;
+    }
+
+    // Returns true if the ' at pos starts a character literal, instead
+    // of being a digit separator like in 1'000'000.
+    inline bool is_character_literal(std::string_view content, size_t pos) {
+        size_t start = pos;
+        while (start > 0 && is_identifier(content[start - 1]))
+            --start;
+        std::string_view prefix = content.substr(start, pos - start);
+        return prefix.empty() || prefix == "L" || prefix == "u" || prefix == "U" || prefix == "u8"
+            || !(prefix[0] >= '0' && prefix[0] <= '9');
+    }
+
+    // Returns true if the " at pos starts a raw string literal.
+    inline bool is_raw_string(std::string_view content, size_t pos) {
+        if (pos == 0 || content[pos - 1] != 'R')
+            return false;
+        size_t start = pos - 1;
+        while (start > 0 && is_identifier(content[start - 1]))
+            --start;
+        std::string_view prefix = content.substr(start, pos - start);
+        return prefix == "R" || prefix == "LR" || prefix == "uR" || prefix == "UR" || prefix == "u8R";
+    }
+
+    // Returns the position after the literal that is opened by the quote at pos.
+    inline size_t skip_literal(std::string_view content, size_t pos, char quote) {
+        for (++pos; pos < content.size(); ++pos) {
+            char c = content[pos];
+            if (c == quote)
+                return pos + 1;
+            if (c == '\\')
+                ++pos;
+            else if (c == '\n')
+                return pos; // Not terminated, so stop at the end of the line.
+        }
+        return content.size();
+    }
+
+    // Returns the position after the raw string literal that is opened by the quote at pos.
+    inline size_t skip_raw_string(std::string_view content, size_t pos) {
+        size_t open = content.find('(', pos);
+        if (open == std::string_view::npos)
+            return content.size();
+        std::string closing = ')' + std::string(content.substr(pos + 1, open - pos - 1)) + '"';
+        size_t close = content.find(closing, open);
+        return close == std::string_view::npos ? content.size() : close + closing.size();
+    }
+}
+
+// Returns true if the source might declare or import a module. This can
+// give false positives, but no false negatives. Headers that the source
+// includes as text are not checked.
+inline bool may_declare_modules(std::string_view content) {
+    using namespace module_prefilter;
+    const char* data = content.data();
+    size_t size = content.size();
+
+    // Skip a UTF-8 byte order mark before the first line.
+    if (is_declaration(content, content.starts_with("\xEF\xBB\xBF") ? 3 : 0))
+        return true;
+
+    size_t pos = 0;
+    while (true) {
+        pos = find_special(data, pos, size);
+        if (pos >= size)
+            return false;
+
+        switch (data[pos]) {
+            case '\n':
+                ++pos;
+                if (is_declaration(content, pos))
+                    return true;
+                break;
+            case '\\':
+                // Skip the escaped character, so a line continuation doesn't start a new line.
+                pos += 2;
+                break;
+            case '/':
+                if (pos + 1 < size && data[pos + 1] == '/') {
+                    // Skip to the end of the line, and keep the newline to check the next line.
+                    do {
+                        pos = content.find('\n', pos + 1);
+                    } while (pos != std::string_view::npos && data[pos - 1] == '\\');
+                    if (pos == std::string_view::npos)
+                        return false;
+                }
+                else if (pos + 1 < size && data[pos + 1] == '*') {
+                    pos = content.find("*/", pos + 2);
+                    if (pos == std::string_view::npos)
+                        return false;
+                    // The declaration might follow a comment at the start of the line.
+                    pos += 2;
+                    if (is_declaration(content, pos))
+                        return true;
+                }
+                else ++pos;
+                break;
+            case '"':
+                pos = is_raw_string(content, pos) ? skip_raw_string(content, pos) : skip_literal(content, pos, '"');
+                break;
+            case '\'':
+                pos = is_character_literal(content, pos) ? skip_literal(content, pos, '\'') : pos + 1;
+                break;
+        }
+    }
+}
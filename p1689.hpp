@@ -0,0 +1,213 @@
+#include <cstdlib>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// Quote the string as a JSON string.
+inline std::string json_quote(std::string_view str) {
+    std::string quoted = "\"";
+    for (char c : str) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        quoted += c;
+    }
+    return quoted + '"';
+}
+
+// Parser and writer for the P1689 module dependency format, which is
+// what clang-scan-deps outputs for -format=p1689.
+namespace p1689 {
+    struct module_t {
+        std::string_view logical_name;
+        std::string_view source_path;
+        std::string_view lookup_method = "by-name";
+        bool is_interface = true;
+    };
+
+    struct rule_t {
+        std::string_view primary_output;
+        std::vector<module_t> provides;
+        std::vector<module_t> imports; // The "requires" of the rule.
+    };
+
+    // Streaming JSON parser for the P1689 format. Strings are unescaped in
+    // place, so the parsed rules point directly into the content.
+    class parser_t {
+    public:
+        parser_t(std::string& content) : p(content.data()), end(content.data() + content.size()) {}
+
+        // Returns false if the content is not valid.
+        bool parse(std::vector<rule_t>& rules) {
+            return parse_object([&] (std::string_view key) {
+                if (key == "rules")
+                    return parse_array([&] { return parse_rule(rules.emplace_back()); });
+                return skip_value();
+            }) && (skip_whitespace(), p == end);
+        }
+
+    private:
+        char* p;
+        char* end;
+
+        void skip_whitespace() {
+            while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+                ++p;
+        }
+
+        bool consume(char c) {
+            skip_whitespace();
+            if (p < end && *p == c) {
+                ++p;
+                return true;
+            }
+            return false;
+        }
+
+        bool parse_rule(rule_t& rule) {
+            return parse_object([&] (std::string_view key) {
+                if (key == "primary-output")
+                    return parse_string(rule.primary_output);
+                else if (key == "provides")
+                    return parse_array([&] { return parse_module(rule.provides.emplace_back()); });
+                else if (key == "requires")
+                    return parse_array([&] { return parse_module(rule.imports.emplace_back()); });
+                return skip_value();
+            });
+        }
+
+        bool parse_module(module_t& module) {
+            return parse_object([&] (std::string_view key) {
+                if (key == "logical-name")
+                    return parse_string(module.logical_name);
+                else if (key == "source-path")
+                    return parse_string(module.source_path);
+                else if (key == "lookup-method")
+                    return parse_string(module.lookup_method);
+                else if (key == "is-interface")
+                    return parse_bool(module.is_interface);
+                return skip_value();
+            });
+        }
+
+        // Calls on_key for every key, which must parse the value.
+        template<typename F>
+        bool parse_object(F&& on_key) {
+            if (!consume('{'))
+                return false;
+            if (consume('}'))
+                return true;
+            do {
+                std::string_view key;
+                if (!parse_string(key) || !consume(':') || !on_key(key))
+                    return false;
+            } while (consume(','));
+            return consume('}');
+        }
+
+        // Calls on_element for every element, which must parse it.
+        template<typename F>
+        bool parse_array(F&& on_element) {
+            if (!consume('['))
+                return false;
+            if (consume(']'))
+                return true;
+            do {
+                if (!on_element())
+                    return false;
+            } while (consume(','));
+            return consume(']');
+        }
+
+        bool parse_string(std::string_view& value) {
+            if (!consume('"'))
+                return false;
+
+            // Unescape in place, which never makes the string longer.
+            char* begin = p;
+            char* out = p;
+            while (p < end && *p != '"') {
+                if (*p == '\\') {
+                    if (++p == end) return false;
+                    switch (*p) {
+                        case 'n': *out++ = '\n'; break;
+                        case 't': *out++ = '\t'; break;
+                        case 'r': *out++ = '\r'; break;
+                        case 'b': *out++ = '\b'; break;
+                        case 'f': *out++ = '\f'; break;
+                        case 'u': {
+                            // Only ASCII is written escaped by clang-scan-deps.
+                            if (end - p < 5) return false;
+                            char hex[5] = { p[1], p[2], p[3], p[4], 0 };
+                            *out++ = (char)strtol(hex, nullptr, 16);
+                            p += 4;
+                            break;
+                        }
+                        default: *out++ = *p; break;
+                    }
+                    ++p;
+                }
+                else *out++ = *p++;
+            }
+            if (p == end)
+                return false;
+            ++p;
+            value = std::string_view(begin, out - begin);
+            return true;
+        }
+
+        bool parse_bool(bool& value) {
+            skip_whitespace();
+            std::string_view rest(p, end - p);
+            if (rest.starts_with("true")) { value = true; p += 4; return true; }
+            if (rest.starts_with("false")) { value = false; p += 5; return true; }
+            return false;
+        }
+
+        bool skip_value() {
+            skip_whitespace();
+            if (p == end)
+                return false;
+            std::string_view dummy;
+            switch (*p) {
+                case '{': return parse_object([&] (std::string_view) { return skip_value(); });
+                case '[': return parse_array([&] { return skip_value(); });
+                case '"': return parse_string(dummy);
+                default:
+                    // Numbers, booleans and null.
+                    while (p < end && *p != ',' && *p != '}' && *p != ']'
+                           && *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t')
+                        ++p;
+                    return true;
+            }
+        }
+    };
+
+    // Write a P1689 file with the given rules.
+    inline void write(std::ostream& out, const std::vector<rule_t>& rules) {
+        auto write_modules = [&] (const char* key, const std::vector<module_t>& modules) {
+            out << ",\n      \"" << key << "\": [";
+            for (size_t i = 0; i < modules.size(); ++i) {
+                const module_t& m = modules[i];
+                out << (i == 0 ? "\n" : ",\n") << "        {\n"
+                    << "          \"is-interface\": " << (m.is_interface ? "true" : "false") << ",\n"
+                    << "          \"logical-name\": " << json_quote(m.logical_name) << ",\n"
+                    << "          \"lookup-method\": " << json_quote(m.lookup_method);
+                if (!m.source_path.empty())
+                    out << ",\n          \"source-path\": " << json_quote(m.source_path);
+                out << "\n        }";
+            }
+            out << "\n      ]";
+        };
+
+        out << "{\n  \"revision\": 0,\n  \"rules\": [";
+        for (size_t i = 0; i < rules.size(); ++i) {
+            out << (i == 0 ? "\n" : ",\n") << "    {\n"
+                << "      \"primary-output\": " << json_quote(rules[i].primary_output);
+            write_modules("provides", rules[i].provides);
+            write_modules("requires", rules[i].imports);
+            out << "\n    }";
+        }
+        out << "\n  ],\n  \"version\": 1\n}\n";
+    }
+}
@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <sched.h>
+#include <unistd.h>
+
+
+namespace resources {
+    // Read the first line of a file in the cgroup of this process. Both
+    // cgroup v2 and the v1 controller hierarchies are checked, both in the
+    // cgroup of the process and in the root (which is what a container sees).
+    inline bool read_cgroup(const std::string& controller, const std::string& file, std::string& value) {
+        std::ifstream cgroups("/proc/self/cgroup");
+        std::string line;
+        std::string paths[2];
+        while (std::getline(cgroups, line)) {
+            // Lines are like "0::/user.slice" (v2) or "4:memory:/docker/id" (v1).
+            size_t first = line.find(':');
+            size_t second = line.find(':', first + 1);
+            if (first == std::string::npos || second == std::string::npos)
+                continue;
+            std::string controllers = "," + line.substr(first + 1, second - first - 1) + ",";
+            if (controllers == ",,")
+                paths[0] = "/sys/fs/cgroup" + line.substr(second + 1);
+            else if (controllers.find("," + controller + ",") != std::string::npos)
+                paths[1] = "/sys/fs/cgroup/" + controller + line.substr(second + 1);
+        }
+        for (const std::string& path : { paths[1], paths[0], "/sys/fs/cgroup/" + controller, std::string("/sys/fs/cgroup") }) {
+            if (path.empty())
+                continue;
+            std::ifstream f(path + "/" + file);
+            if (std::getline(f, value))
+                return true;
+        }
+        return false;
+    }
+
+    // The number of CPUs this process can use, which is limited by its
+    // affinity mask and the CPU quota of its cgroup.
+    inline size_t cpu_count() {
+        size_t count = std::max(std::thread::hardware_concurrency(), 1u);
+
+        cpu_set_t set;
+        if (sched_getaffinity(0, sizeof(set), &set) == 0)
+            count = std::min<size_t>(count, std::max(CPU_COUNT(&set), 1));
+
+        // cgroup v2 has "<quota> <period>" in cpu.max, v1 has them in separate files.
+        std::string quota, period;
+        if (read_cgroup("cpu", "cpu.max", quota)) {
+            std::istringstream line(quota);
+            line >> quota >> period;
+        }
+        else if (read_cgroup("cpu", "cpu.cfs_quota_us", quota))
+            read_cgroup("cpu", "cpu.cfs_period_us", period);
+
+        if (quota != "max" && !quota.empty() && !period.empty()) {
+            int64_t q = std::stoll(quota);
+            int64_t p = std::stoll(period);
+            if (q > 0 && p > 0)
+                count = std::min<size_t>(count, std::max<int64_t>((q + p - 1) / p, 1));
+        }
+        return count;
+    }
+
+    // The number of bytes of memory that can still be used, which is the
+    // lowest of the available system memory and what is left in the cgroup.
+    inline uint64_t available_memory() {
+        uint64_t available = UINT64_MAX;
+        std::ifstream meminfo("/proc/meminfo");
+        std::string key;
+        uint64_t value;
+        while (meminfo >> key >> value) {
+            if (key == "MemAvailable:") {
+                available = value * 1024;
+                break;
+            }
+            meminfo.ignore(64, '\n');
+        }
+
+        std::string limit, usage;
+        if ((read_cgroup("memory", "memory.max", limit) && read_cgroup("memory", "memory.current", usage))
+            || (read_cgroup("memory", "memory.limit_in_bytes", limit) && read_cgroup("memory", "memory.usage_in_bytes", usage))) {
+            if (limit != "max") {
+                uint64_t l = std::stoull(limit);
+                uint64_t u = std::stoull(usage);
+                available = std::min(available, l > u ? l - u : 0);
+            }
+        }
+        return available;
+    }
+
+    // The resident memory of the process and the processes it started, in
+    // bytes. A compiler driver runs the actual compiler as its child.
+    inline uint64_t process_memory(pid_t pid) {
+        std::string path = "/proc/" + std::to_string(pid);
+        uint64_t total = 0;
+        uint64_t size, resident;
+        std::ifstream statm(path + "/statm");
+        if (statm >> size >> resident)
+            total += resident * sysconf(_SC_PAGESIZE);
+
+        std::ifstream children(path + "/task/" + std::to_string(pid) + "/children");
+        pid_t child;
+        while (children >> child)
+            total += process_memory(child);
+        return total;
+    }
+}
+
+
+// Limits the number of jobs that run at the same time, by a maximum number
+// of jobs and by the available memory, using how much memory each job is
+// expected to use at its peak. The available memory is checked again every
+// time a job is started, so this adjusts to the memory used by other
+// processes while the build runs.
+class ResourceLimiter {
+public:
+    // Allows a job to run, until it is destroyed.
+    class Slot {
+    public:
+        Slot(ResourceLimiter* limiter, uint64_t id) : limiter(limiter), id(id) {}
+        Slot(Slot&& other) : limiter(other.limiter), id(other.id) { other.limiter = nullptr; }
+        Slot& operator=(Slot&&) = delete;
+        ~Slot() {
+            if (limiter != nullptr)
+                limiter->release(id);
+        }
+
+        // Set the process of the job, so the memory it already uses isn't
+        // reserved a second time.
+        void set_pid(pid_t pid) {
+            if (limiter != nullptr)
+                limiter->set_pid(id, pid);
+        }
+
+    private:
+        ResourceLimiter* limiter;
+        uint64_t id;
+    };
+
+    void set_job_limit(size_t limit) {
+        std::unique_lock<std::mutex> lock(mutex);
+        job_limit = std::max<size_t>(limit, 1);
+    }
+
+    // Wait until a job that is expected to use the given amount of memory can
+    // run. If this is 0, the average of the observed jobs is used. A job is
+    // always allowed to run if nothing else is running.
+    Slot acquire(uint64_t expected_memory) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (expected_memory == 0 && observed_count > 0)
+            expected_memory = observed_total / observed_count;
+
+        // The running jobs might not have reached their peak yet, so what they
+        // still need to reach it is reserved on top of what's available now.
+        while (!jobs.empty() && (jobs.size() >= job_limit
+                                 || reserved_memory() + expected_memory > resources::available_memory())) {
+            // Memory can also be freed by other processes, so check again after a while.
+            condition.wait_for(lock, std::chrono::milliseconds(500));
+        }
+        uint64_t id = next_id++;
+        jobs.emplace(id, job_t { expected_memory, 0 });
+        return Slot(this, id);
+    }
+
+    // Add the peak memory use of a finished job, for the jobs without an estimate.
+    void observe(uint64_t peak_memory) {
+        std::unique_lock<std::mutex> lock(mutex);
+        observed_total += peak_memory;
+        ++observed_count;
+    }
+
+private:
+    struct job_t {
+        uint64_t expected_memory;
+        pid_t pid; // 0 until the process is started.
+    };
+
+    std::mutex mutex;
+    std::condition_variable condition;
+    size_t job_limit = SIZE_MAX;
+    std::unordered_map<uint64_t, job_t> jobs;
+    uint64_t next_id = 0;
+    uint64_t observed_total = 0;
+    size_t observed_count = 0;
+
+    // The memory the running jobs are expected to use on top of what they
+    // use now, which is already missing from the available memory.
+    uint64_t reserved_memory() {
+        uint64_t reserved = 0;
+        for (auto& [id, job] : jobs) {
+            uint64_t used = job.pid != 0 ? resources::process_memory(job.pid) : 0;
+            reserved += job.expected_memory > used ? job.expected_memory - used : 0;
+        }
+        return reserved;
+    }
+
+    void set_pid(uint64_t id, pid_t pid) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = jobs.find(id);
+        if (it != jobs.end())
+            it->second.pid = pid;
+    }
+
+    void release(uint64_t id) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            jobs.erase(id);
+        }
+        condition.notify_all();
+    }
+};
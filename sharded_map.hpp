@@ -0,0 +1,85 @@
+#include <array>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+
+// Hash map that can be used from many threads at once. The entries are
+// split over a number of shards, which each have their own lock, so
+// threads only contend when they use the same shard at the same time.
+template<typename Key, typename Value, typename Hash = std::hash<Key>, size_t ShardCount = 64>
+class ShardedMap {
+public:
+    // Get the value of the key. If it doesn't exist yet, it is created with
+    // make(), which is called without holding the lock so slow work doesn't
+    // block the other threads. If two threads create the same key at once
+    // the first one is kept.
+    template<typename F>
+    Value get_or_insert(const Key& key, F&& make) {
+        size_t hash = Hash()(key);
+        Shard& shard = shards[hash % ShardCount];
+        {
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            auto it = shard.map.find(HashedKey { key, hash });
+            if (it != shard.map.end())
+                return it->second;
+        }
+
+        Value value = make();
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        return shard.map.emplace(key, std::move(value)).first->second;
+    }
+
+    // Insert all the entries, locking every shard only once.
+    void insert(std::vector<std::pair<Key, Value>>&& entries) {
+        std::array<std::vector<std::pair<Key, Value>*>, ShardCount> per_shard;
+        for (auto& entry : entries)
+            per_shard[Hash()(entry.first) % ShardCount].push_back(&entry);
+
+        for (size_t i = 0; i < ShardCount; ++i) {
+            if (per_shard[i].empty())
+                continue;
+            std::unique_lock<std::mutex> lock(shards[i].mutex);
+            for (auto* entry : per_shard[i])
+                shards[i].map.emplace(std::move(entry->first), std::move(entry->second));
+        }
+    }
+
+    // Call f with every entry. Must not be called while other threads modify the map.
+    template<typename F>
+    void for_each(F&& f) const {
+        for (const Shard& shard : shards)
+            for (const auto& [key, value] : shard.map)
+                f(key, value);
+    }
+
+private:
+    // Lets the shards reuse the hash that was used to select them.
+    struct HashedKey {
+        const Key& key;
+        size_t hash;
+    };
+
+    struct ShardHash {
+        using is_transparent = void;
+        size_t operator()(const Key& key) const { return Hash()(key); }
+        size_t operator()(const HashedKey& key) const { return key.hash; }
+    };
+
+    struct ShardEqual {
+        using is_transparent = void;
+        bool operator()(const Key& a, const Key& b) const { return a == b; }
+        bool operator()(const HashedKey& a, const Key& b) const { return a.key == b; }
+        bool operator()(const Key& a, const HashedKey& b) const { return a == b.key; }
+    };
+
+    // Aligned to a cache line, so the locks of different shards don't share one.
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_map<Key, Value, ShardHash, ShardEqual> map;
+    };
+
+    std::array<Shard, ShardCount> shards;
+};
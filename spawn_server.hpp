@@ -0,0 +1,469 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+// Starts processes from a small helper process, which is forked before the
+// application is loaded. Forking the host of a live session has to copy the
+// page tables of the whole application, while the helper stays small. The
+// processes are started with posix_spawn, without a shell in between.
+//
+// Every request sends the arguments and one end of a new socket pair to the
+// helper, which sends the process id back over it when the process is
+// started, and the exit status and resource usage when it exits. A thread in
+// this process waits for the replies of all the requests with epoll, so no
+// thread has to wait for a process that is running.
+//
+// The helper runs a single epoll loop, with a pidfd for every process and
+// pipes for their output. The output of a process is written in one piece
+// when it exits, so the output of compilers that run at the same time
+// isn't mixed up.
+class SpawnServer {
+public:
+    // Called with the id of the process when it is started.
+    using start_callback_t = std::function<void(pid_t pid)>;
+    // Called with the wait status, or -1 if the process couldn't be started,
+    // and the peak memory use of the process in bytes.
+    using exit_callback_t = std::function<void(int status, uint64_t peak_memory)>;
+
+    ~SpawnServer() {
+        if (waiter.joinable()) {
+            uint64_t stop = 1;
+            ssize_t written = write(stop_fd, &stop, sizeof(stop));
+            (void)written;
+            // The program can exit from one of the callbacks.
+            if (waiter.get_id() == std::this_thread::get_id())
+                waiter.detach();
+            else
+                waiter.join();
+        }
+        for (int fd : { socket_fd, epoll_fd, stop_fd })
+            if (fd >= 0)
+                close(fd);
+    }
+
+    // Fork the helper process. Must be called before other threads are
+    // started. The helper exits when this process closes the socket.
+    // Needs pidfds, which are supported since Linux 5.3.
+    bool start() {
+        int pid_fd = pidfd_open(getpid());
+        if (pid_fd < 0)
+            return false;
+        close(pid_fd);
+
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0)
+            return false;
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            return false;
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            serve(fds[1]);
+            _exit(0);
+        }
+        close(fds[1]);
+        socket_fd = fds[0];
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        stop_fd = eventfd(0, EFD_CLOEXEC);
+        epoll_event stop_event { EPOLLIN, { .ptr = nullptr } };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd, &stop_event);
+        waiter = std::thread([this] { wait_for_replies(); });
+        return true;
+    }
+
+    // Start the command without waiting for it. The callbacks are called from
+    // the thread that waits for the replies, so they should return quickly.
+    // If the helper isn't started, or the command doesn't fit in a request,
+    // the command is run from this process and the callbacks are called
+    // before this returns.
+    void start_process(const std::vector<std::string>& arguments, exit_callback_t on_exit,
+                       start_callback_t on_start = nullptr) {
+        if (arguments.empty()) {
+            on_exit(-1, 0);
+            return;
+        }
+        if (socket_fd < 0 || !request(arguments, on_exit, on_start)) {
+            reply_t reply;
+            if (spawn_and_wait(arguments, reply, on_start))
+                on_exit(reply.status, (uint64_t)reply.usage.ru_maxrss * 1024);
+            else
+                on_exit(-1, 0);
+        }
+    }
+
+    // Run the command and wait for it. Returns the wait status, or -1 if it
+    // couldn't be started. The peak memory use of the command is in bytes.
+    int run(const std::vector<std::string>& arguments, uint64_t& peak_memory) {
+        std::promise<int> status;
+        start_process(arguments, [&] (int exit_status, uint64_t peak) {
+            peak_memory = peak;
+            status.set_value(exit_status);
+        });
+        return status.get_future().get();
+    }
+
+private:
+    // A reply of the helper, when the process is started and when it exits.
+    struct reply_t {
+        bool exited = false;
+        pid_t pid = 0;
+        int status = -1;
+        rusage usage {};
+    };
+
+    // A request of which the process hasn't exited yet.
+    struct request_t {
+        int reply_fd;
+        exit_callback_t on_exit;
+        start_callback_t on_start;
+    };
+
+    // A process started by the helper.
+    struct job_t {
+        pid_t pid = 0;
+        int pid_fd = -1;
+        int reply_fd = -1;
+        int output_fds[2] = { -1, -1 }; // stdout and stderr.
+        std::string output[2];
+    };
+
+    int socket_fd = -1;
+    int epoll_fd = -1;
+    int stop_fd = -1;
+    std::thread waiter;
+
+    static int pidfd_open(pid_t pid) {
+        return (int)syscall(SYS_pidfd_open, pid, 0);
+    }
+
+    // Send the arguments separated by null characters, with the socket for the
+    // replies. Returns false if the command doesn't fit in a request, and
+    // otherwise calls on_exit when it fails.
+    bool request(const std::vector<std::string>& arguments, exit_callback_t& on_exit,
+                 start_callback_t& on_start) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+            on_exit(-1, 0);
+            return true;
+        }
+
+        std::string message;
+        for (const std::string& argument : arguments) {
+            message += argument;
+            message += '\0';
+        }
+        iovec data { message.data(), message.size() };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr header {};
+        header.msg_iov = &data;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        cmsghdr* fd_message = CMSG_FIRSTHDR(&header);
+        fd_message->cmsg_level = SOL_SOCKET;
+        fd_message->cmsg_type = SCM_RIGHTS;
+        fd_message->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(fd_message), &fds[1], sizeof(int));
+
+        ssize_t sent;
+        while ((sent = sendmsg(socket_fd, &header, MSG_NOSIGNAL)) < 0 && errno == EINTR) {}
+        close(fds[1]);
+        // Commands that don't fit in the socket buffer, like very long link commands, are run from here.
+        if (sent < 0 && errno == EMSGSIZE) {
+            close(fds[0]);
+            return false;
+        }
+        if (sent != (ssize_t)message.size()) {
+            close(fds[0]);
+            on_exit(-1, 0);
+            return true;
+        }
+
+        request_t* r = new request_t { fds[0], std::move(on_exit), std::move(on_start) };
+        epoll_event event { EPOLLIN, { .ptr = r } };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[0], &event);
+        return true;
+    }
+
+    // The loop of the thread that waits for the replies.
+    void wait_for_replies() {
+        epoll_event events[64];
+        while (true) {
+            int count = epoll_wait(epoll_fd, events, 64, -1);
+            if (count < 0) {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+
+            for (int i = 0; i < count; ++i) {
+                request_t* r = (request_t*)events[i].data.ptr;
+                if (r == nullptr)
+                    return;
+
+                reply_t reply;
+                ssize_t received;
+                while ((received = recv(r->reply_fd, &reply, sizeof(reply), 0)) < 0 && errno == EINTR) {}
+                if (received == sizeof(reply) && !reply.exited) {
+                    if (r->on_start)
+                        r->on_start(reply.pid);
+                    continue;
+                }
+
+                // The socket is closed without a reply if the process couldn't be started.
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, r->reply_fd, nullptr);
+                close(r->reply_fd);
+                if (received == sizeof(reply))
+                    r->on_exit(reply.status, (uint64_t)reply.usage.ru_maxrss * 1024);
+                else
+                    r->on_exit(-1, 0);
+                delete r;
+            }
+        }
+    }
+
+    static bool spawn(const std::vector<std::string>& arguments, pid_t& pid,
+                      const posix_spawn_file_actions_t* file_actions = nullptr) {
+        std::vector<char*> argv;
+        for (const std::string& argument : arguments)
+            argv.push_back((char*)argument.c_str());
+        argv.push_back(nullptr);
+
+        // The helper blocks and ignores some signals, which the processes shouldn't inherit.
+        posix_spawnattr_t attributes;
+        posix_spawnattr_init(&attributes);
+        sigset_t mask, defaults;
+        sigemptyset(&mask);
+        sigemptyset(&defaults);
+        sigaddset(&defaults, SIGINT);
+        sigaddset(&defaults, SIGQUIT);
+        posix_spawnattr_setsigmask(&attributes, &mask);
+        posix_spawnattr_setsigdefault(&attributes, &defaults);
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+        int err = posix_spawnp(&pid, argv[0], file_actions, &attributes, argv.data(), environ);
+        posix_spawnattr_destroy(&attributes);
+        if (err != 0)
+            fprintf(stderr, "Could not start %s: %s\n", argv[0], strerror(err));
+        return err == 0;
+    }
+
+    static bool spawn_and_wait(const std::vector<std::string>& arguments, reply_t& reply,
+                               const start_callback_t& on_start) {
+        pid_t pid;
+        if (!spawn(arguments, pid))
+            return false;
+        if (on_start)
+            on_start(pid);
+        while (wait4(pid, &reply.status, 0, &reply.usage) < 0) {
+            if (errno != EINTR)
+                return false;
+        }
+        return true;
+    }
+
+    // Start the process with its output going to pipes, and add it to the epoll set.
+    static job_t* start_job(int epoll_fd, const std::vector<std::string>& arguments, int reply_fd) {
+        job_t* job = new job_t;
+        job->reply_fd = reply_fd;
+        int write_fds[2] = { -1, -1 };
+        posix_spawn_file_actions_t file_actions;
+        posix_spawn_file_actions_init(&file_actions);
+        bool started = true;
+        for (int i = 0; i < 2 && started; ++i) {
+            int fds[2];
+            started = pipe2(fds, O_CLOEXEC) == 0;
+            if (started) {
+                // Only this end is non-blocking, the process writes to a normal pipe.
+                fcntl(fds[0], F_SETFL, O_NONBLOCK);
+                job->output_fds[i] = fds[0];
+                write_fds[i] = fds[1];
+                posix_spawn_file_actions_adddup2(&file_actions, fds[1], STDOUT_FILENO + i);
+            }
+        }
+        started = started && spawn(arguments, job->pid, &file_actions);
+        posix_spawn_file_actions_destroy(&file_actions);
+        for (int fd : write_fds)
+            if (fd >= 0)
+                close(fd);
+        if (started)
+            job->pid_fd = pidfd_open(job->pid);
+
+        if (job->pid_fd < 0) {
+            if (started)
+                waitpid(job->pid, nullptr, 0);
+            finish_job(epoll_fd, job, nullptr);
+            return nullptr;
+        }
+
+        epoll_event event { EPOLLIN, { .ptr = job } };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, job->pid_fd, &event);
+        for (int fd : job->output_fds)
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+        reply_t reply;
+        reply.pid = job->pid;
+        send(job->reply_fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+        return job;
+    }
+
+    // Read the output of the job that is available now. The pipe is closed
+    // when the process and its children have closed it.
+    static void read_output(int epoll_fd, job_t* job, int i) {
+        char buffer[16384];
+        while (job->output_fds[i] >= 0) {
+            ssize_t n = read(job->output_fds[i], buffer, sizeof(buffer));
+            if (n > 0)
+                job->output[i].append(buffer, n);
+            else if (n < 0 && errno == EINTR)
+                continue;
+            else {
+                if (n == 0 || errno != EAGAIN) {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, job->output_fds[i], nullptr);
+                    close(job->output_fds[i]);
+                    job->output_fds[i] = -1;
+                }
+                return;
+            }
+        }
+    }
+
+    static void write_all(int fd, const std::string& data) {
+        for (size_t written = 0; written < data.size(); ) {
+            ssize_t n = write(fd, data.data() + written, data.size() - written);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return;
+            written += n;
+        }
+    }
+
+    // Write the output of the job, reply to the requester and clean up. The
+    // reply socket is closed without a reply if there is no reply.
+    static void finish_job(int epoll_fd, job_t* job, const reply_t* reply) {
+        for (int i = 0; i < 2; ++i) {
+            read_output(epoll_fd, job, i);
+            if (job->output_fds[i] >= 0) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, job->output_fds[i], nullptr);
+                close(job->output_fds[i]);
+            }
+            write_all(STDOUT_FILENO + i, job->output[i]);
+        }
+        if (job->pid_fd >= 0) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, job->pid_fd, nullptr);
+            close(job->pid_fd);
+        }
+        if (reply != nullptr)
+            send(job->reply_fd, reply, sizeof(*reply), MSG_NOSIGNAL);
+        close(job->reply_fd);
+        delete job;
+    }
+
+    // Receive a request from the socket. Returns false if the socket is closed.
+    static bool receive(int socket_fd, std::vector<char>& message,
+                        std::vector<std::string>& arguments, int& reply_fd) {
+        // Make room for long commands, which can't be split over messages.
+        ssize_t size = recv(socket_fd, nullptr, 0, MSG_PEEK | MSG_TRUNC);
+        if (size <= 0)
+            return size < 0 && errno == EINTR;
+        if ((size_t)size > message.size())
+            message.resize(size);
+
+        iovec data { message.data(), message.size() };
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr header {};
+        header.msg_iov = &data;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        size = recvmsg(socket_fd, &header, MSG_CMSG_CLOEXEC);
+        cmsghdr* fd_message = CMSG_FIRSTHDR(&header);
+        if (size <= 0 || fd_message == nullptr || fd_message->cmsg_type != SCM_RIGHTS)
+            return true;
+        memcpy(&reply_fd, CMSG_DATA(fd_message), sizeof(int));
+
+        for (const char* p = message.data(); p < message.data() + size; p += strlen(p) + 1)
+            arguments.emplace_back(p);
+        return true;
+    }
+
+    // The loop of the helper process.
+    static void serve(int socket_fd) {
+        // Report interrupted processes instead of being interrupted with them.
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+
+        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        epoll_event socket_event { EPOLLIN, { .ptr = nullptr } };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &socket_event);
+
+        // Marks the events of jobs that were finished earlier in the same batch.
+        static char finished;
+        std::vector<char> message(1 << 16);
+        epoll_event events[64];
+        while (true) {
+            int count = epoll_wait(epoll_fd, events, 64, -1);
+            if (count < 0) {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+
+            for (int i = 0; i < count; ++i) {
+                if (events[i].data.ptr == &finished)
+                    continue;
+                job_t* job = (job_t*)events[i].data.ptr;
+                if (job == nullptr) {
+                    std::vector<std::string> arguments;
+                    int reply_fd = -1;
+                    if (!receive(socket_fd, message, arguments, reply_fd))
+                        return;
+                    if (!arguments.empty())
+                        start_job(epoll_fd, arguments, reply_fd);
+                    else if (reply_fd >= 0)
+                        close(reply_fd);
+                    continue;
+                }
+
+                // All the fds of the job are checked for every event of it.
+                for (int j = 0; j < 2; ++j)
+                    read_output(epoll_fd, job, j);
+
+                reply_t reply;
+                reply.exited = true;
+                reply.pid = job->pid;
+                if (wait4(job->pid, &reply.status, WNOHANG, &reply.usage) == job->pid) {
+                    // Skip the other events of the job in this batch, as it is deleted.
+                    for (int j = i + 1; j < count; ++j)
+                        if (events[j].data.ptr == job)
+                            events[j].data.ptr = &finished;
+                    finish_job(epoll_fd, job, &reply);
+                }
+            }
+        }
+    }
+};
@@ -1,138 +1,297 @@
+#include <atomic>
 #include <condition_variable>
-#include <functional>
+#include <cstddef>
+#include <deque>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <new>
 #include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 
-// Class that represents a simple thread pool
+// A bool() callable, which returns true if an error occurred. Small
+// callables (like lambdas with a few captures) are stored inline, so
+// creating a task doesn't allocate like a std::function would.
+class Task {
+public:
+    Task() = default;
+
+    template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Task>>>
+    Task(F&& f) {
+        using T = std::decay_t<F>;
+        if constexpr (fits_inline<T>()) {
+            new (storage) T(std::forward<F>(f));
+            ops = &inline_ops<T>;
+        }
+        else {
+            *(T**)storage = new T(std::forward<F>(f));
+            ops = &heap_ops<T>;
+        }
+    }
+
+    Task(Task&& other) noexcept { take(other); }
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+
+    ~Task() { reset(); }
+
+    bool operator()() { return ops->invoke(storage); }
+
+private:
+    static constexpr size_t SIZE = 64;
+
+    struct ops_t {
+        bool (*invoke)(void*);
+        void (*move)(void* from, void* to); // Also destroys from.
+        void (*destroy)(void*);
+    };
+
+    template<typename T>
+    static constexpr bool fits_inline() {
+        return sizeof(T) <= SIZE && alignof(T) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible_v<T>;
+    }
+
+    template<typename T>
+    static constexpr ops_t inline_ops = {
+        [] (void* p) -> bool { return (*(T*)p)(); },
+        [] (void* from, void* to) { new (to) T(std::move(*(T*)from)); ((T*)from)->~T(); },
+        [] (void* p) { ((T*)p)->~T(); },
+    };
+
+    template<typename T>
+    static constexpr ops_t heap_ops = {
+        [] (void* p) -> bool { return (**(T**)p)(); },
+        [] (void* from, void* to) { *(T**)to = *(T**)from; },
+        [] (void* p) { delete *(T**)p; },
+    };
+
+    void take(Task& other) {
+        ops = other.ops;
+        if (ops != nullptr)
+            ops->move(other.storage, storage);
+        other.ops = nullptr;
+    }
+
+    void reset() {
+        if (ops != nullptr)
+            ops->destroy(storage);
+        ops = nullptr;
+    }
+
+    alignas(std::max_align_t) unsigned char storage[SIZE];
+    const ops_t* ops = nullptr;
+};
+
+
+class ThreadPool;
+
+// A set of tasks in a thread pool that can be waited for together. The
+// pool can run the tasks of many groups at once, so waiting for one group
+// doesn't wait for the work of the others.
+class TaskGroup {
+public:
+    TaskGroup() = default;
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    // True if one of the tasks of the group had an error.
+    bool got_error() const { return error.load(); }
+
+private:
+    friend class ThreadPool;
+    std::atomic<size_t> active = 0; // Tasks that are in a queue or running, and holds.
+    std::atomic<bool> error = false;
+};
+
+
+// Thread pool in which every worker has its own queue. Tasks enqueued by a
+// worker go to the back of its own queue, and are also taken from the back,
+// so dependent work stays on the same core. Workers that run out of tasks
+// steal from the front of the other queues. Only one sleeping worker is
+// woken per enqueued task, instead of all of them. The pool is meant to
+// live as long as the program, with the work of every phase in it.
 class ThreadPool {
 public:
-    // // Constructor to creates a thread pool with given
-    // number of threads
     ThreadPool(size_t num_threads = 0) {
         if (num_threads == 0)
             num_threads = std::thread::hardware_concurrency();
+        if (num_threads == 0)
+            num_threads = 1;
 
-        // Creating worker threads
-        for (size_t i = 0; i < num_threads; ++i) {
-            threads.emplace_back([this] {
-                while (true) {
-                    std::function<bool()> task;
-
-                    // The reason for putting the below code
-                    // here is to unlock the queue before
-                    // executing the task so that other
-                    // threads can perform enqueue tasks
-                    {
-                        // Locking the queue so that data
-                        // can be shared safely
-                        std::unique_lock<std::mutex> lock(mutex);
-
-                        // Waiting until there is a task to
-                        // execute or the pool is stopped
-                        condition.wait(lock, [this] {
-                            return !tasks.empty() || stop;
-                        });
-
-                        // exit the thread in case the pool
-                        // is stopped and there are no tasks
-                        if (stop && tasks.empty()) {
-                            return;
-                        }
-
-                        // Get the next task from the queue
-                        task = std::move(tasks.front());
-                        tasks.pop();
-                        number_working++;
-                    }
-
-                    bool error = task();
-
-                    // Stop if one of the tasks has an error.
-                    {
-                        std::unique_lock<std::mutex> lock(mutex);
-                        number_working--;
-                        if (error) {
-                            got_error = true;
-                            stop = true;
-                        }
-                    }
-
-                    // Notify others that the task has been finished.
-                    // or that we should stop.
-                    condition.notify_all();
-                }
-            });
-        }
+        queues = std::make_unique<Queue[]>(num_threads);
+        queue_count = num_threads;
+        for (size_t i = 0; i < num_threads; ++i)
+            threads.emplace_back([this, i] { work(i); });
     }
 
-    // Destructor to stop the thread pool
-    ~ThreadPool()
-    {
+    // Runs the tasks that are still queued before stopping the workers.
+    ~ThreadPool() {
         {
-            // Lock the queue to update the stop flag safely
-            std::unique_lock<std::mutex> lock(mutex);
+            std::unique_lock<std::mutex> lock(sleep_mutex);
             stop = true;
         }
+        wake.notify_all();
+        for (std::thread& thread : threads)
+            thread.join();
+    }
 
-        // Notify all threads
-        condition.notify_all();
+    // Wait until all the tasks of the group are done. The waiting thread
+    // runs queued tasks in the meantime, which may be of other groups.
+    void wait(TaskGroup& group) {
+        size_t i = current_pool == this ? current_worker : 0;
+        while (group.active.load() > 0) {
+            Task task;
+            TaskGroup* task_group;
+            if (pending.load() > 0 && take(i, task, task_group)) {
+                pending.fetch_sub(1);
+                run(task, task_group);
+                continue;
+            }
 
-        // Joining all worker threads to ensure they have
-        // completed their tasks
-        for (auto& thread : threads) {
-            thread.join();
+            // Wait until the last task of the group is done.
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            done.wait(lock, [&] { return group.active.load() == 0; });
         }
     }
 
-    void join() {
+    // Enqueue task for execution by the thread pool, as part of the group.
+    // If it is called from one of the workers, the task goes to the
+    // worker's own queue.
+    template<typename F>
+    void enqueue(TaskGroup& group, F&& task) {
+        size_t i = current_pool == this ? current_worker
+            : next_queue.fetch_add(1, std::memory_order_relaxed) % queue_count;
+
+        group.active.fetch_add(1);
         {
-            // Waiting until there are no tasks to execute anymore, and then stop.
-            std::unique_lock<std::mutex> lock(mutex);
-            condition.wait(lock, [this] {
-                return (tasks.empty() && number_working == 0) || stop;
-            });
+            std::unique_lock<std::mutex> lock(queues[i].mutex);
+            queues[i].tasks.push_back({ Task(std::forward<F>(task)), &group });
+        }
+        pending.fetch_add(1);
 
-            stop = true;
+        // Only take the lock if a worker might be waiting for a task.
+        if (sleeping.load() > 0) {
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.notify_one();
         }
+    }
 
-        condition.notify_all();
-        for (auto& thread : threads)
-            thread.join();
-        threads.clear();
+    // Keep the group open for work that is done outside of the pool, like a
+    // process that is running, until release is called for it.
+    void hold(TaskGroup& group) {
+        group.active.fetch_add(1);
     }
 
-    // Enqueue task for execution by the thread pool
-    void enqueue(std::function<bool()> task)
-    {
+    void release(TaskGroup& group) {
+        finish(group);
+    }
+
+private:
+    struct entry_t {
+        Task task;
+        TaskGroup* group;
+    };
+
+    // Aligned to a cache line, so the queues don't share one.
+    struct alignas(64) Queue {
+        std::mutex mutex;
+        std::deque<entry_t> tasks;
+    };
+
+    inline static thread_local ThreadPool* current_pool = nullptr;
+    inline static thread_local size_t current_worker = 0;
+
+    std::vector<std::thread> threads;
+    std::unique_ptr<Queue[]> queues;
+    size_t queue_count;
+    std::atomic<size_t> next_queue = 0;
+
+    // Tasks that are in a queue. Can briefly be negative, when a
+    // task is taken before the enqueue has counted it.
+    std::atomic<long> pending = 0;
+    std::atomic<size_t> sleeping = 0; // Workers that are waiting for a task.
+
+    // Protects stop, and is used to sleep and to wait for groups.
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool stop = false;
+
+    // Take a task from the back of the own queue, or else from the front of another one.
+    bool take(size_t i, Task& task, TaskGroup*& group) {
         {
-            std::unique_lock<std::mutex> lock(mutex);
-            tasks.emplace(std::move(task));
+            std::unique_lock<std::mutex> lock(queues[i].mutex);
+            if (!queues[i].tasks.empty()) {
+                task = std::move(queues[i].tasks.back().task);
+                group = queues[i].tasks.back().group;
+                queues[i].tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t j = 1; j < queue_count; ++j) {
+            Queue& victim = queues[(i + j) % queue_count];
+            std::unique_lock<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front().task);
+                group = victim.tasks.front().group;
+                victim.tasks.pop_front();
+                return true;
+            }
         }
-        condition.notify_all();
+        return false;
     }
 
-    bool got_error = false;
+    void run(Task& task, TaskGroup* group) {
+        if (task())
+            group->error.store(true);
+        finish(*group);
+    }
 
-private:
-    // Vector to store worker threads
-    std::vector<std::thread> threads;
+    void finish(TaskGroup& group) {
+        if (group.active.fetch_sub(1) == 1) {
+            // Take the lock, so the notify can't happen between the check and the wait of wait().
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            done.notify_all();
+        }
+    }
 
-    // Queue of tasks
-    std::queue<std::function<bool()> > tasks;
+    void work(size_t i) {
+        current_pool = this;
+        current_worker = i;
 
-    // Mutex to synchronize access to shared data
-    std::mutex mutex;
+        while (true) {
+            Task task;
+            TaskGroup* group;
+            if (pending.load() > 0 && take(i, task, group)) {
+                pending.fetch_sub(1);
+                run(task, group);
+                continue;
+            }
 
-    // Condition variable to signal changes in the state of
-    // the tasks queue
-    std::condition_variable condition;
+            // Other tasks are often enqueued right after, so don't go to sleep immediately.
+            for (int spin = 0; spin < 16 && pending.load() <= 0; ++spin)
+                std::this_thread::yield();
+            if (pending.load() > 0)
+                continue;
 
-    // Flag to indicate whether the thread pool should stop
-    // or not
-    bool stop = false;
+            // Wait until there is a task, or the pool is stopped.
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            sleeping.fetch_add(1);
+            wake.wait(lock, [this] { return pending.load() > 0 || stop; });
+            sleeping.fetch_sub(1);
 
-    //
-    int number_working = 0;
+            // Exit the thread when the pool is stopped and there are no tasks left.
+            if (stop && pending.load() <= 0)
+                return;
+        }
+    }
 };